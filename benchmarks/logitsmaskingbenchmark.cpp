@@ -0,0 +1,99 @@
+// Compares apply_token_bitmask_inplace() with the loop integrators usually write over
+// the output of TokenEnforcer::get_allowed_tokens().
+// Usage: benchlogitsmasking [vocab_size] [num_rows]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+#include <lmfe/logitsmasking.hpp>
+
+typedef std::chrono::steady_clock Clock;
+
+// The hand written version: start from an all -inf row and copy the allowed logits into it
+void naive_mask(std::vector<float>& logits, const std::vector<int>& allowed_tokens, std::vector<float>& scratch) {
+    std::fill(scratch.begin(), scratch.end(), -std::numeric_limits<float>::infinity());
+    for (int token_id : allowed_tokens) {
+        scratch[token_id] = logits[token_id];
+    }
+    logits.swap(scratch);
+}
+
+template <class F>
+double time_per_row_ns(int num_rows, F function) {
+    auto start = Clock::now();
+    for (int row = 0; row < num_rows; ++row) {
+        function();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    return static_cast<double>(elapsed) / num_rows;
+}
+
+const char* implementation_name(LogitsMaskingImplementation implementation) {
+    switch (implementation) {
+        case LogitsMaskingImplementation::AVX512: return "avx512";
+        case LogitsMaskingImplementation::AVX2: return "avx2";
+        case LogitsMaskingImplementation::SCALAR: return "scalar";
+        default: return "auto";
+    }
+}
+
+int main(int argc, char** argv) {
+    const int vocab_size = argc > 1 ? std::atoi(argv[1]) : 151936;
+    const int num_rows = argc > 2 ? std::atoi(argv[2]) : 2000;
+    const double densities[] = {0.0001, 0.01, 0.5, 0.99};
+
+    std::mt19937 generator(1234);
+    std::uniform_real_distribution<float> logit_distribution(-10.0f, 10.0f);
+    std::vector<float> original_logits(vocab_size);
+    for (float& logit : original_logits) {
+        logit = logit_distribution(generator);
+    }
+    std::vector<uint16_t> original_16bit_logits(vocab_size, 0x3C00);
+
+    std::cout << "vocab_size=" << vocab_size << " rows=" << num_rows << " (ns per row)" << std::endl;
+    for (double density : densities) {
+        std::bernoulli_distribution allowed_distribution(density);
+        TokenBitmask bitmask(vocab_size);
+        for (int token_id = 0; token_id < vocab_size; ++token_id) {
+            if (allowed_distribution(generator)) {
+                bitmask.set(token_id);
+            }
+        }
+        std::vector<int> allowed_tokens = bitmask.to_token_list();
+
+        std::vector<float> logits = original_logits;
+        std::vector<float> scratch(vocab_size);
+        double naive_ns = time_per_row_ns(num_rows, [&]() {
+            naive_mask(logits, allowed_tokens, scratch);
+        });
+        std::cout << "density=" << density << " allowed=" << allowed_tokens.size() << std::endl;
+        std::cout << "  naive token list loop    " << naive_ns << std::endl;
+
+        const LogitsMaskingImplementation implementations[] = {
+            LogitsMaskingImplementation::SCALAR,
+            LogitsMaskingImplementation::AVX2,
+            LogitsMaskingImplementation::AVX512
+        };
+        for (LogitsMaskingImplementation requested : implementations) {
+            LogitsMaskingImplementation implementation = select_logits_masking_implementation(requested);
+            if (implementation != requested) {
+                continue;
+            }
+            // Masking is idempotent, so reusing the same row measures the steady state cost
+            logits = original_logits;
+            double f32_ns = time_per_row_ns(num_rows, [&]() {
+                apply_token_bitmask_inplace(logits.data(), logits.size(), bitmask);
+            });
+            std::vector<uint16_t> bf16_logits = original_16bit_logits;
+            double bf16_ns = time_per_row_ns(num_rows, [&]() {
+                apply_token_bitmask_inplace_bf16(bf16_logits.data(), bf16_logits.size(), bitmask);
+            });
+            std::cout << "  bitmask " << implementation_name(implementation) << " f32 " << f32_ns << " bf16 " << bf16_ns << std::endl;
+        }
+        select_logits_masking_implementation(LogitsMaskingImplementation::AUTO);
+    }
+    return 0;
+}
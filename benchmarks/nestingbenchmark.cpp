@@ -0,0 +1,56 @@
+// Measures JsonSchemaParser::add_character() at increasing nesting depths. The token enforcer advances the parser once per
+// tokenizer tree edge it explores, always from a handful of states, so this times the same fan out: every allowed
+// character is added to a fixed state. With the stack shared between states the cost should not grow with the depth.
+// Usage: benchnesting [num_runs]
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <lmfe/jsonschemaparser.hpp>
+
+typedef std::chrono::steady_clock Clock;
+
+// depth nested arrays of integers, e.g. depth 2 is [[1, 2], [3]]
+std::string nested_array_schema(int depth) {
+    std::string schema = R"({"type": "integer"})";
+    for (int level = 0; level < depth; ++level) {
+        schema = R"({"type": "array", "items": )" + schema + "}";
+    }
+    return schema;
+}
+
+int main(int argc, char** argv) {
+    const int num_runs = argc > 1 ? std::atoi(argv[1]) : 20000;
+    const int depths[] = {1, 4, 16, 64, 256};
+
+    std::cout << "runs=" << num_runs << " (ns per add_character)" << std::endl;
+    for (int depth : depths) {
+        CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(nested_array_schema(depth), nullptr);
+        // Inside the innermost list, after its first digit
+        for (char character : std::string(depth, '[') + "1") {
+            parser = parser->add_character(character);
+        }
+        std::string allowed_characters = parser->get_allowed_characters();
+        std::size_t stack_size = static_cast<JsonSchemaParser*>(parser.get())->object_stack.size();
+
+        std::size_t num_states = 0;
+        auto start = Clock::now();
+        for (int run = 0; run < num_runs; ++run) {
+            for (char character : allowed_characters) {
+                CharacterLevelParserPtr next_parser = parser->add_character(character);
+                num_states += next_parser->can_end() ? 0 : 1;
+            }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        double ns_per_character = static_cast<double>(elapsed) / (static_cast<double>(num_runs) * allowed_characters.size());
+        std::cout << "depth " << depth << " (stack of " << stack_size << ", " << allowed_characters.size()
+                  << " allowed characters): " << ns_per_character << " ns" << std::endl;
+        if (num_states == 0) {
+            std::cerr << "Unexpected end of the document" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
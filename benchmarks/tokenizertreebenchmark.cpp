@@ -0,0 +1,224 @@
+// Compares the flat TokenizerPrefixTree with the pointer based tree it replaced (one heap node per character,
+// children in an unordered_map), on memory and on the walks and lookups TokenEnforcer does over it.
+// Usage: benchtokenizertree [vocabulary_file] [num_walks]
+// The vocabulary file holds one token per line. Without it, a synthetic 150k token vocabulary is generated.
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <lmfe/tokenizerdata.hpp>
+
+typedef std::chrono::steady_clock Clock;
+
+// Live heap bytes (requested sizes), so that both trees are measured the same way
+static std::size_t live_bytes = 0;
+
+void* operator new(std::size_t size) {
+    std::size_t* block = static_cast<std::size_t*>(std::malloc(size + sizeof(std::max_align_t)));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *block = size;
+    live_bytes += size;
+    return reinterpret_cast<char*>(block) + sizeof(std::max_align_t);
+}
+
+void operator delete(void* pointer) noexcept {
+    if (pointer == nullptr) {
+        return;
+    }
+    std::size_t* block = reinterpret_cast<std::size_t*>(static_cast<char*>(pointer) - sizeof(std::max_align_t));
+    live_bytes -= *block;
+    std::free(block);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    operator delete(pointer);
+}
+
+// The previous representation
+struct PointerTreeNode {
+    std::vector<int> tokens;
+    std::unordered_map<char, PointerTreeNode*> children;
+};
+
+PointerTreeNode* build_pointer_tree(const std::vector<std::tuple<int, std::string, bool>>& regular_tokens) {
+    PointerTreeNode* root = new PointerTreeNode();
+    for (const auto& token : regular_tokens) {
+        PointerTreeNode* node = root;
+        for (char character : std::get<1>(token)) {
+            PointerTreeNode*& child = node->children[character];
+            if (child == nullptr) {
+                child = new PointerTreeNode();
+            }
+            node = child;
+        }
+        node->tokens.push_back(std::get<0>(token));
+    }
+    return root;
+}
+
+void free_pointer_tree(PointerTreeNode* node) {
+    for (const auto& entry : node->children) {
+        free_pointer_tree(entry.second);
+    }
+    delete node;
+}
+
+// Both walks mimic _collect_allowed_tokens(), with a fixed set of allowed characters instead of a parser.
+// excluded_character stands for the '"' that ends a JSON string.
+void walk_pointer_tree(const PointerTreeNode* node, char excluded_character, TokenBitmask& allowed_tokens) {
+    for (int token_id : node->tokens) {
+        allowed_tokens.set(token_id);
+    }
+    for (const auto& entry : node->children) {
+        if (entry.first != excluded_character) {
+            walk_pointer_tree(entry.second, excluded_character, allowed_tokens);
+        }
+    }
+}
+
+void walk_flat_tree(const TokenizerPrefixTree& tree, uint32_t tree_node, char excluded_character, TokenBitmask& allowed_tokens) {
+    tree.add_node_tokens(tree_node, allowed_tokens);
+    const TokenizerPrefixTreeNode& node = tree.nodes[tree_node];
+    for (uint32_t child = node.first_child; child < node.first_child + node.num_children; ++child) {
+        if (tree.node_characters[child] != excluded_character) {
+            walk_flat_tree(tree, child, excluded_character, allowed_tokens);
+        }
+    }
+}
+
+// Looks up every token's path from the root, like _get_forced_continuation() does
+std::size_t lookup_pointer_tree(const PointerTreeNode* root, const std::vector<std::string>& token_strs) {
+    std::size_t found = 0;
+    for (const std::string& token_str : token_strs) {
+        const PointerTreeNode* node = root;
+        for (char character : token_str) {
+            node = node->children.find(character)->second;
+        }
+        found += node->tokens.size();
+    }
+    return found;
+}
+
+std::size_t lookup_flat_tree(const TokenizerPrefixTree& tree, const std::vector<std::string>& token_strs) {
+    std::size_t found = 0;
+    for (const std::string& token_str : token_strs) {
+        uint32_t node = TokenizerPrefixTree::ROOT;
+        for (char character : token_str) {
+            node = tree.find_child(node, character);
+        }
+        found += tree.nodes[node].num_tokens;
+    }
+    return found;
+}
+
+std::vector<std::string> synthetic_vocabulary(std::size_t vocab_size) {
+    // Words over a skewed alphabet, so that prefixes are shared the way they are in a BPE vocabulary
+    const std::string common = "etaoinshrdlucmfwypvbgkjqxz";
+    const std::string rare = "ETAOINSHRDLUCMFWYPVBGKJQXZ0123456789.,:;!?'\"-_()[]{}<>/\\@#$%^&*+=~`|";
+    std::mt19937 generator(1234);
+    std::geometric_distribution<int> length_distribution(0.25);
+    std::geometric_distribution<std::size_t> common_distribution(0.15);
+    std::uniform_int_distribution<std::size_t> rare_distribution(0, rare.size() - 1);
+    std::bernoulli_distribution rare_character(0.1), leading_space(0.5);
+    std::unordered_map<std::string, bool> seen;
+    std::vector<std::string> vocabulary;
+    while (vocabulary.size() < vocab_size) {
+        std::string token = leading_space(generator) ? " " : "";
+        int length = 1 + length_distribution(generator);
+        for (int char_idx = 0; char_idx < length; ++char_idx) {
+            token += rare_character(generator) ? rare[rare_distribution(generator)]
+                                               : common[common_distribution(generator) % common.size()];
+        }
+        if (!seen[token]) {
+            seen[token] = true;
+            vocabulary.push_back(token);
+        }
+    }
+    return vocabulary;
+}
+
+template <class F>
+double time_per_run_us(int num_runs, F function) {
+    auto start = Clock::now();
+    for (int run = 0; run < num_runs; ++run) {
+        function();
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    return static_cast<double>(elapsed) / num_runs / 1000.0;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> vocabulary;
+    if (argc > 1) {
+        std::ifstream vocabulary_file(argv[1]);
+        std::string line;
+        while (std::getline(vocabulary_file, line)) {
+            vocabulary.push_back(line);
+        }
+    } else {
+        vocabulary = synthetic_vocabulary(150000);
+    }
+    const int num_walks = argc > 2 ? std::atoi(argv[2]) : 50;
+
+    std::vector<std::tuple<int, std::string, bool>> regular_tokens;
+    for (std::size_t token_idx = 0; token_idx < vocabulary.size(); ++token_idx) {
+        regular_tokens.emplace_back(static_cast<int>(token_idx), vocabulary[token_idx], false);
+    }
+    const std::size_t vocab_size = regular_tokens.size();
+
+    std::size_t bytes_before = live_bytes;
+    PointerTreeNode* pointer_tree = build_pointer_tree(regular_tokens);
+    std::size_t pointer_tree_bytes = live_bytes - bytes_before;
+
+    // The flat tree also keeps tokens_to_strs / new_word_tokens, which the old tree kept next to it as well
+    bytes_before = live_bytes;
+    TokenizerPrefixTree flat_tree(regular_tokens);
+    std::size_t flat_tree_bytes = flat_tree.memory_size();
+    std::size_t flat_tree_total_bytes = live_bytes - bytes_before;
+
+    std::cout << "vocab_size=" << vocab_size << " nodes=" << flat_tree.nodes.size() << std::endl;
+    std::cout << "memory: pointer tree " << pointer_tree_bytes / 1024 << " KiB, flat tree " << flat_tree_bytes / 1024
+              << " KiB (" << flat_tree_total_bytes / 1024 << " KiB with the token string map)" << std::endl;
+
+    const char excluded_characters[] = {'\0', '"'};
+    for (char excluded_character : excluded_characters) {
+        TokenBitmask pointer_tokens(vocab_size);
+        TokenBitmask flat_tokens(vocab_size);
+        double pointer_us = time_per_run_us(num_walks, [&]() {
+            pointer_tokens.clear();
+            walk_pointer_tree(pointer_tree, excluded_character, pointer_tokens);
+        });
+        double flat_us = time_per_run_us(num_walks, [&]() {
+            flat_tokens.clear();
+            walk_flat_tree(flat_tree, TokenizerPrefixTree::ROOT, excluded_character, flat_tokens);
+        });
+        if (pointer_tokens.to_token_list() != flat_tokens.to_token_list()) {
+            std::cerr << "The trees disagree on the walk" << std::endl;
+            return 1;
+        }
+        std::cout << (excluded_character == '\0' ? "full walk" : "walk without '\"'") << ": pointer tree "
+                  << pointer_us << " us, flat tree " << flat_us << " us (" << pointer_us / flat_us << "x)" << std::endl;
+    }
+
+    std::size_t pointer_found = 0, flat_found = 0;
+    double pointer_us = time_per_run_us(num_walks, [&]() { pointer_found = lookup_pointer_tree(pointer_tree, vocabulary); });
+    double flat_us = time_per_run_us(num_walks, [&]() { flat_found = lookup_flat_tree(flat_tree, vocabulary); });
+    if (pointer_found != flat_found) {
+        std::cerr << "The trees disagree on the lookups" << std::endl;
+        return 1;
+    }
+    std::cout << "path lookups: pointer tree " << pointer_us << " us, flat tree " << flat_us << " us ("
+              << pointer_us / flat_us << "x)" << std::endl;
+
+    free_pointer_tree(pointer_tree);
+    return 0;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <mutex>
+#include "./characterlevelparser.hpp"
+#include "./lrucache.hpp"
+#include "./tokenmask.hpp"
+
+// Allowed token masks keyed by parser structure (CharacterLevelParser::cache_key() / cache_equals()).
+// It lives on the tokenizer data, so every sequence and enforcer that reaches an equivalent parser state with the
+// same tokenizer reuses the mask instead of walking the tokenizer tree again, e.g. every item of a list of integers.
+// Entries keep their parser alive, which keeps the schema pointers inside its key valid. Thread safe.
+class AllowedTokenCache {
+public:
+    static const std::size_t DEFAULT_MAX_MEMORY = 128 * 1024 * 1024;
+
+    AllowedTokenCache() : entries(0, DEFAULT_MAX_MEMORY) {}
+
+    // 0 means unlimited. Memory is an estimate of the masks held.
+    void set_limits(std::size_t max_entries, std::size_t max_memory_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.set_limits(max_entries, max_memory_bytes);
+        entries.evict(can_always_evict);
+    }
+
+    // Returns nullptr if there is no mask for an equivalent parser. parser_key is parser->cache_key(), which must not be 0.
+    TokenMaskPtr get(const CharacterLevelParserPtr& parser, std::size_t parser_key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        TokenMaskPtr* mask = entries.get(Key{parser, parser_key});
+        return mask != nullptr ? *mask : TokenMaskPtr();
+    }
+
+    void put(const CharacterLevelParserPtr& parser, std::size_t parser_key, TokenMaskPtr mask) {
+        std::size_t memory = sizeof(TokenMask) + mask->memory_size();
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.put(Key{parser, parser_key}, mask, memory);
+        entries.evict(can_always_evict);
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.clear();
+    }
+
+    std::size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    struct Key {
+        CharacterLevelParserPtr parser;
+        std::size_t parser_key;
+
+        bool operator==(const Key& other) const {
+            return parser_key == other.parser_key && parser->cache_equals(*other.parser);
+        }
+    };
+
+    struct KeyHasher {
+        std::size_t operator()(const Key& key) const { return key.parser_key; }
+    };
+
+    static bool can_always_evict(const Key&, const TokenMaskPtr&) { return true; }
+
+    std::mutex mutex;
+    LRUCache<Key, TokenMaskPtr, KeyHasher> entries;
+};
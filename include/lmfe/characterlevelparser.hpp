@@ -1,14 +1,41 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
-#include <unordered_set>
 #include <stdexcept>
 #include <memory>
 #include <iostream>
+#include <typeinfo>
+#include "./characterset.hpp"
 
 class CharacterLevelParser;
 typedef std::shared_ptr<CharacterLevelParser> CharacterLevelParserPtr;
 
+// Describes a parser state whose allowed tokens the TokenEnforcer can mostly look up instead of walking the tokenizer tree
+struct ShortcutKey {
+    enum class Kind {
+        NONE,
+        // Every token made only of character_class characters is allowed, as long as it has no run of run_limited_characters
+        // longer than max_run and fits in the remaining length (e.g. digits of a number, or the contents of a JSON string).
+        // Only the tokens that leave the class need a tree walk.
+        CHARACTER_CLASS
+    };
+
+    Kind kind = Kind::NONE;
+    std::string character_class;
+    std::string run_limited_characters;
+    std::size_t max_run = 0;
+    // Length limits of the value being parsed, -1 when there is no such limit
+    std::size_t cur_length = 0;
+    std::size_t min_length = -1;
+    std::size_t max_length = -1;
+};
+
+// Mixes value into seed, used to build CharacterLevelParser::cache_key() out of a parser's fields
+inline void hash_combine(std::size_t& seed, std::size_t value) {
+    seed ^= value + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
 
 class CharacterLevelParser : public std::enable_shared_from_this<CharacterLevelParser> {
 public:
@@ -18,10 +45,57 @@ public:
     }
 
     virtual CharacterLevelParserPtr add_character(char new_character) = 0;
-    virtual std::string get_allowed_characters() const = 0;
+    // Adds the characters one after the other, as add_character() would. Returns nullptr if one of them is not allowed.
+    // Parsers override it to take runs of characters (e.g. the contents of a string) without building the states in between.
+    virtual CharacterLevelParserPtr add_string(std::string_view characters) {
+        CharacterLevelParserPtr parser = shared_from_this();
+        for (char character : characters) {
+            if (!parser->get_allowed_character_set().contains(character)) {
+                return nullptr;
+            }
+            parser = parser->add_character(character);
+        }
+        return parser;
+    }
+    // The characters that add_character() accepts. Each of these defaults to the other, so a parser has to override
+    // at least one of them. get_allowed_character_set() is the one the token enforcer calls for every tree node it visits.
+    virtual std::string get_allowed_characters() const { return get_allowed_character_set().to_string(); }
+    virtual CharacterSet get_allowed_character_set() const { return CharacterSet(get_allowed_characters()); }
     virtual bool can_end() const = 0;
-    virtual std::string shortcut_key() const { return ""; }
+    virtual ShortcutKey shortcut_key() const { return ShortcutKey(); }
+    // Parsers with equal cache keys that are cache_equals() to each other accept exactly the same strings from now on,
+    // so the tokens allowed for one of them can be reused for the other. 0 means that the parser can not be cached.
     virtual std::size_t cache_key() const { return 0; }
+    virtual bool cache_equals(const CharacterLevelParser&) const { return false; }
+
+protected:
+    // Starts a cache key from the parser's dynamic type, so different parser types rarely collide
+    std::size_t type_cache_key() const { return typeid(*this).hash_code(); }
+    static std::size_t nonzero_cache_key(std::size_t key) { return key == 0 ? 1 : key; }
+
+    // Helpers for parsers that are made of other parsers
+    static std::size_t combine_cache_keys(std::size_t seed, const std::vector<CharacterLevelParserPtr>& parsers) {
+        for (const CharacterLevelParserPtr& parser : parsers) {
+            std::size_t parser_key = parser->cache_key();
+            if (parser_key == 0) {
+                return 0;
+            }
+            hash_combine(seed, parser_key);
+        }
+        return nonzero_cache_key(seed);
+    }
+
+    static bool parsers_cache_equal(const std::vector<CharacterLevelParserPtr>& parsers, const std::vector<CharacterLevelParserPtr>& other_parsers) {
+        if (parsers.size() != other_parsers.size()) {
+            return false;
+        }
+        for (std::size_t idx = 0; idx < parsers.size(); ++idx) {
+            if (!parsers[idx]->cache_equals(*other_parsers[idx])) {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 class CharacterLevelParserConfig {
@@ -41,14 +115,34 @@ public:
         }
     }
 
-    std::string get_allowed_characters() const override {
-        return target_str.empty() ? "" : target_str.substr(0, 1);
+    CharacterLevelParserPtr add_string(std::string_view characters) override {
+        if (characters.empty()) {
+            return shared_from_this();
+        }
+        if (std::string_view(target_str).substr(0, characters.size()) != characters) {
+            return nullptr;
+        }
+        return std::make_shared<StringParser>(target_str.substr(characters.size()));
+    }
+
+    CharacterSet get_allowed_character_set() const override {
+        return target_str.empty() ? CharacterSet() : CharacterSet().add(target_str[0]);
     }
 
     bool can_end() const override {
         return target_str.empty();
     }
 
+    std::size_t cache_key() const override {
+        std::size_t key = type_cache_key();
+        hash_combine(key, std::hash<std::string>()(target_str));
+        return nonzero_cache_key(key);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        return typeid(other) == typeid(*this) && static_cast<const StringParser&>(other).target_str == target_str;
+    }
+
 private:
     std::string target_str;
 };
@@ -56,16 +150,24 @@ private:
 class ForceStopParser : public CharacterLevelParser {
 public:
     CharacterLevelParserPtr add_character(char new_character) override {
-        return CharacterLevelParserPtr(this);
+        return shared_from_this();
     }
 
-    std::string get_allowed_characters() const override {
-        return "";
+    CharacterSet get_allowed_character_set() const override {
+        return CharacterSet();
     }
 
     bool can_end() const override {
         return true;
     }
+
+    std::size_t cache_key() const override {
+        return nonzero_cache_key(type_cache_key());
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        return typeid(other) == typeid(*this);
+    }
 };
 
 class UnionParser : public CharacterLevelParser {
@@ -75,7 +177,7 @@ public:
     CharacterLevelParserPtr add_character(const char new_character) override {
         std::vector<CharacterLevelParserPtr> relevant_parsers;
         for (CharacterLevelParserPtr parser : parsers) {
-            if (parser->get_allowed_characters().find(new_character) != std::string::npos) {
+            if (parser->get_allowed_character_set().contains(new_character)) {
                 relevant_parsers.push_back(parser->add_character(new_character));
             }
         }
@@ -85,13 +187,12 @@ public:
         return CharacterLevelParserPtr(new UnionParser(relevant_parsers));
     }
 
-    std::string get_allowed_characters() const override {
-        std::unordered_set<char> allowed;
-        for (CharacterLevelParserPtr parser : parsers) {
-            const std::string& allowed_characters = parser->get_allowed_characters();
-            allowed.insert(allowed_characters.begin(), allowed_characters.end());
+    CharacterSet get_allowed_character_set() const override {
+        CharacterSet allowed_characters;
+        for (const CharacterLevelParserPtr& parser : parsers) {
+            allowed_characters |= parser->get_allowed_character_set();
         }
-        return std::string(allowed.begin(), allowed.end());
+        return allowed_characters;
     }
 
     bool can_end() const override {
@@ -103,6 +204,14 @@ public:
         return false;
     }
 
+    std::size_t cache_key() const override {
+        return combine_cache_keys(type_cache_key(), parsers);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        return typeid(other) == typeid(*this) && parsers_cache_equal(parsers, static_cast<const UnionParser&>(other).parsers);
+    }
+
 private:
     std::vector<CharacterLevelParserPtr> parsers;
 };
@@ -115,7 +224,7 @@ public:
         std::vector<CharacterLevelParserPtr> legal_parsers;
         for (std::size_t idx = 0; idx < parsers.size(); ++idx) {
             CharacterLevelParserPtr parser = parsers[idx];
-            if (parser->get_allowed_characters().find(new_character) != std::string::npos) {
+            if (parser->get_allowed_character_set().contains(new_character)) {
                 CharacterLevelParserPtr updated_parser = parser->add_character(new_character);
                 std::vector<CharacterLevelParserPtr> next_parsers(parsers.begin() + idx + 1, parsers.end());
                 next_parsers.insert(next_parsers.begin(), updated_parser);
@@ -131,16 +240,15 @@ public:
         return CharacterLevelParserPtr(new UnionParser(legal_parsers));
     }
 
-    std::string get_allowed_characters() const override {
-        std::unordered_set<char> allowed_characters;
-        for (CharacterLevelParserPtr parser : parsers) {
-            const std::string& parser_allowed_characters = parser->get_allowed_characters();
-            allowed_characters.insert(parser_allowed_characters.begin(), parser_allowed_characters.end());
+    CharacterSet get_allowed_character_set() const override {
+        CharacterSet allowed_characters;
+        for (const CharacterLevelParserPtr& parser : parsers) {
+            allowed_characters |= parser->get_allowed_character_set();
             if (!parser->can_end()) {
                 break;
             }
         }
-        return std::string(allowed_characters.begin(), allowed_characters.end());
+        return allowed_characters;
     }
 
     bool can_end() const override {
@@ -152,6 +260,14 @@ public:
         return true;
     }
 
+    std::size_t cache_key() const override {
+        return combine_cache_keys(type_cache_key(), parsers);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        return typeid(other) == typeid(*this) && parsers_cache_equal(parsers, static_cast<const SequenceParser&>(other).parsers);
+    }
+
 private:
     std::vector<CharacterLevelParserPtr> parsers;
 };
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <iterator>
+#include <string>
+
+// A set of byte values, one bit per character. It is a plain value (no allocation), so parsers can build, copy and
+// merge the characters they allow in the innermost loop of the tokenizer tree walk: union is four ORs and membership
+// is one bit test.
+class CharacterSet {
+public:
+    typedef uint64_t Word;
+    static const int NUM_WORDS = 4;
+    static const int BITS_PER_WORD = 64;
+
+    CharacterSet() : words{0, 0, 0, 0} {}
+    CharacterSet(const char* characters) : CharacterSet() { add(characters); }
+    CharacterSet(const std::string& characters) : CharacterSet() { add(characters); }
+
+    bool contains(char character) const {
+        unsigned char value = static_cast<unsigned char>(character);
+        return (words[value / BITS_PER_WORD] >> (value % BITS_PER_WORD)) & 1;
+    }
+
+    CharacterSet& add(char character) {
+        unsigned char value = static_cast<unsigned char>(character);
+        words[value / BITS_PER_WORD] |= Word(1) << (value % BITS_PER_WORD);
+        return *this;
+    }
+
+    CharacterSet& add(const char* characters) {
+        for (; *characters != '\0'; ++characters) {
+            add(*characters);
+        }
+        return *this;
+    }
+
+    CharacterSet& add(const std::string& characters) {
+        for (char character : characters) {
+            add(character);
+        }
+        return *this;
+    }
+
+    CharacterSet& remove(char character) {
+        unsigned char value = static_cast<unsigned char>(character);
+        words[value / BITS_PER_WORD] &= ~(Word(1) << (value % BITS_PER_WORD));
+        return *this;
+    }
+
+    CharacterSet& operator|=(const CharacterSet& other) {
+        for (int word_idx = 0; word_idx < NUM_WORDS; ++word_idx) {
+            words[word_idx] |= other.words[word_idx];
+        }
+        return *this;
+    }
+
+    CharacterSet& operator&=(const CharacterSet& other) {
+        for (int word_idx = 0; word_idx < NUM_WORDS; ++word_idx) {
+            words[word_idx] &= other.words[word_idx];
+        }
+        return *this;
+    }
+
+    // Removes the characters of other
+    CharacterSet& operator-=(const CharacterSet& other) {
+        for (int word_idx = 0; word_idx < NUM_WORDS; ++word_idx) {
+            words[word_idx] &= ~other.words[word_idx];
+        }
+        return *this;
+    }
+
+    friend CharacterSet operator|(CharacterSet left, const CharacterSet& right) { return left |= right; }
+    friend CharacterSet operator&(CharacterSet left, const CharacterSet& right) { return left &= right; }
+    friend CharacterSet operator-(CharacterSet left, const CharacterSet& right) { return left -= right; }
+
+    bool operator==(const CharacterSet& other) const {
+        for (int word_idx = 0; word_idx < NUM_WORDS; ++word_idx) {
+            if (words[word_idx] != other.words[word_idx]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool operator!=(const CharacterSet& other) const { return !(*this == other); }
+
+    bool empty() const { return (words[0] | words[1] | words[2] | words[3]) == 0; }
+
+    // Whether every character of other is in the set
+    bool contains_all(const CharacterSet& other) const { return (other - *this).empty(); }
+
+    std::size_t size() const {
+        std::size_t count = 0;
+        for (int word_idx = 0; word_idx < NUM_WORDS; ++word_idx) {
+            for (Word word = words[word_idx]; word; word &= word - 1) {
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // Visits the characters in increasing byte value
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef char value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const char* pointer;
+        typedef char reference;
+
+        const_iterator(const CharacterSet* set, int value) : set(set), value(value) { skip_missing(); }
+
+        char operator*() const { return static_cast<char>(value); }
+        const_iterator& operator++() {
+            ++value;
+            skip_missing();
+            return *this;
+        }
+        const_iterator operator++(int) {
+            const_iterator previous = *this;
+            ++*this;
+            return previous;
+        }
+        bool operator==(const const_iterator& other) const { return value == other.value; }
+        bool operator!=(const const_iterator& other) const { return value != other.value; }
+
+    private:
+        void skip_missing() {
+            while (value < NUM_WORDS * BITS_PER_WORD) {
+                Word remaining = set->words[value / BITS_PER_WORD] >> (value % BITS_PER_WORD);
+                if (remaining != 0) {
+                    value += count_trailing_zeros(remaining);
+                    return;
+                }
+                value = (value / BITS_PER_WORD + 1) * BITS_PER_WORD;
+            }
+        }
+
+        const CharacterSet* set;
+        int value;
+    };
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, NUM_WORDS * BITS_PER_WORD); }
+
+    std::string to_string() const { return std::string(begin(), end()); }
+
+private:
+    static int count_trailing_zeros(Word word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctzll(word);
+#else
+        int count = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            count++;
+        }
+        return count;
+#endif
+    }
+
+    Word words[NUM_WORDS];
+};
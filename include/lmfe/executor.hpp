@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs batches of independent tasks for TokenEnforcer.
+// Hosts that already own a thread pool can implement this interface so lmfe does not start a second one.
+class TokenEnforcerExecutor {
+public:
+    virtual ~TokenEnforcerExecutor() {}
+
+    // Runs every task and returns once all of them finished. The calling thread may run tasks as well.
+    // If a task throws, the first exception is rethrown to the caller after the batch completes.
+    virtual void run_all(const std::vector<std::function<void()>>& tasks) = 0;
+
+    // How many tasks can make progress at the same time, used to decide how finely to split work
+    virtual std::size_t concurrency() const = 0;
+
+    // Runs the task in the background and returns right away, e.g. to compute the next mask during a forward pass.
+    // The task must not throw. The default starts a thread per task, executors that own threads should queue it instead.
+    virtual void submit(std::function<void()> task) {
+        std::thread(std::move(task)).detach();
+    }
+};
+
+typedef std::shared_ptr<TokenEnforcerExecutor> TokenEnforcerExecutorPtr;
+
+// Default executor: a fixed set of worker threads sharing a queue of task batches.
+// Idle workers (and the thread that called run_all) claim the next unstarted task of a batch,
+// so a worker that finishes early takes over work that would otherwise wait behind a slow task.
+class ThreadPoolExecutor : public TokenEnforcerExecutor {
+public:
+    // num_threads includes the calling thread, 0 means std::thread::hardware_concurrency()
+    explicit ThreadPoolExecutor(std::size_t num_threads = 0);
+    ~ThreadPoolExecutor();
+
+    void run_all(const std::vector<std::function<void()>>& tasks) override;
+    std::size_t concurrency() const override { return workers.size() + 1; }
+    // Queued behind earlier batches. Without worker threads the task runs on the calling thread.
+    // Tasks that are still queued when the executor is destroyed are dropped.
+    void submit(std::function<void()> task) override;
+
+private:
+    struct Batch {
+        // Only dereferenced after claiming a task, the caller keeps the vector alive until every task finished
+        const std::vector<std::function<void()>>* tasks;
+        // Holds the task of a submit() batch, which has no caller waiting on it
+        std::vector<std::function<void()>> submitted_tasks;
+        std::size_t num_tasks;
+        std::atomic<std::size_t> next_task;
+        std::atomic<std::size_t> remaining_tasks;
+        std::mutex mutex;
+        std::condition_variable finished;
+        std::exception_ptr error;
+    };
+
+    void worker_loop();
+    static void run_available_tasks(Batch& batch);
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_available;
+    std::deque<std::shared_ptr<Batch>> pending_batches;
+    bool stopping;
+};
@@ -2,20 +2,169 @@
 #include <vector>
 #include <string>
 #include "./characterlevelparser.hpp"
+#include "./lrucache.hpp"
 #include "./nlohmann_json.hpp"
 #include "./valijson_nlohmann_bundled.hpp"
 
+#include <cstdint>
+#include <iterator>
 #include <memory>
+#include <mutex>
 
 using json = nlohmann::json;
 using Schema = valijson::Schema;
 
+// The strings that a JSON value can still be (the values of an enum, or the keys an object has left) as a prefix tree
+class StringTrie {
+public:
+    static const uint32_t ROOT = 0;
+    static const uint32_t NO_NODE = UINT32_MAX;
+
+    explicit StringTrie(std::vector<std::string> strings);
+
+    // NO_NODE if no string continues with character
+    uint32_t find_child(uint32_t node, char character) const;
+    CharacterSet get_next_characters(uint32_t node) const {
+        return node == NO_NODE ? CharacterSet() : nodes[node].next_characters;
+    }
+    bool is_string_end(uint32_t node) const { return node != NO_NODE && nodes[node].is_string_end; }
+
+    // Sorted and unique
+    const std::vector<std::string>& get_strings() const { return strings; }
+    std::size_t get_hash() const { return hash; }
+    bool operator==(const StringTrie& other) const {
+        return this == &other || (hash == other.hash && strings == other.strings);
+    }
+
+private:
+    struct Node {
+        CharacterSet next_characters;
+        bool is_string_end;
+        // Sorted by character
+        std::vector<std::pair<char, uint32_t>> children;
+    };
+
+    std::vector<std::string> strings;
+    std::vector<Node> nodes;
+    std::size_t hash;
+};
+
+typedef std::shared_ptr<const StringTrie> StringTriePtr;
+
+// A schema node with everything the parsing states need resolved once, when the parser is created, so that they
+// never search the valijson constraints. Nodes point at each other (recursive schemas are cycles) and are owned by
+// JsonSchemaParser::_Context, except for the nodes of the "any JSON value" schema, which are shared by all parsers.
+struct CompiledSchema {
+    enum class Kind {
+        ANY_OF,
+        // One of a fixed set of values: enums, booleans and null
+        ENUM,
+        STRING,
+        INTEGER,
+        NUMBER,
+        OBJECT,
+        ARRAY,
+        // A schema the parser does not support, error is thrown once a value of it is parsed
+        UNSUPPORTED
+    };
+
+    Kind kind = Kind::UNSUPPORTED;
+    std::string error;
+    // ANY_OF
+    std::vector<const CompiledSchema*> any_of;
+    // ENUM. The values of string enums are quoted in the output, the others are written as JSON.
+    StringTriePtr enum_values;
+    bool enum_is_quoted = false;
+    // STRING, -1 when there is no limit
+    std::size_t min_length = -1;
+    std::size_t max_length = -1;
+    // ARRAY, -1 when there is no limit
+    const CompiledSchema* items = nullptr;
+    std::size_t min_items = -1;
+    std::size_t max_items = -1;
+    // OBJECT. keys holds the properties and the required keys, sorted. key_schemas[i] is the value schema of keys[i],
+    // nullptr for a required key that is not a property. Key bitmasks (required_keys, property_keys) index into keys.
+    bool is_dictionary = true;
+    std::vector<std::string> keys;
+    std::vector<const CompiledSchema*> key_schemas;
+    std::vector<uint64_t> required_keys;
+    std::vector<uint64_t> property_keys;
+    // The value schema of dictionaries
+    const CompiledSchema* additional_properties = nullptr;
+
+    // -1 if key is not in keys
+    int find_key(const std::string& key) const;
+};
+
 class JsonSchemaParser;
-extern CharacterLevelParserPtr get_parser(JsonSchemaParser* parser, const valijson::Subschema* schema);
+extern CharacterLevelParserPtr get_parser(JsonSchemaParser* parser, const CompiledSchema* schema);
+
+// The parsers of the JSON values that are open at a point of the output, innermost on top. It is a linked list of
+// immutable frames: a copy shares all of its frames with the original, and push() / pop() on it only change the copy.
+// Advancing a JsonSchemaParser by one character therefore costs the same at any nesting depth.
+class ParserStack {
+private:
+    struct Frame {
+        CharacterLevelParserPtr parser;
+        std::shared_ptr<const Frame> below;
+    };
+
+public:
+    ParserStack() : num_frames(0) {}
+
+    bool empty() const { return num_frames == 0; }
+    std::size_t size() const { return num_frames; }
+    const CharacterLevelParserPtr& top() const { return top_frame->parser; }
+
+    void push(CharacterLevelParserPtr parser) {
+        top_frame = std::make_shared<const Frame>(Frame{std::move(parser), std::move(top_frame)});
+        num_frames++;
+    }
+
+    void pop() {
+        top_frame = top_frame->below;
+        num_frames--;
+    }
+
+    // Whether both stacks are made of the same frames
+    bool shares_frames_with(const ParserStack& other) const { return top_frame == other.top_frame; }
+
+    // Visits the parsers from the top of the stack to its bottom
+    class const_iterator {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef CharacterLevelParserPtr value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const CharacterLevelParserPtr* pointer;
+        typedef const CharacterLevelParserPtr& reference;
+
+        explicit const_iterator(const Frame* frame) : frame(frame) {}
+
+        const CharacterLevelParserPtr& operator*() const { return frame->parser; }
+        const CharacterLevelParserPtr* operator->() const { return &frame->parser; }
+        const_iterator& operator++() {
+            frame = frame->below.get();
+            return *this;
+        }
+        bool operator==(const const_iterator& other) const { return frame == other.frame; }
+        bool operator!=(const const_iterator& other) const { return frame != other.frame; }
+
+    private:
+        const Frame* frame;
+    };
+
+    const_iterator begin() const { return const_iterator(top_frame.get()); }
+    const_iterator end() const { return const_iterator(nullptr); }
+
+private:
+    std::shared_ptr<const Frame> top_frame;
+    std::size_t num_frames;
+};
 
 class JsonSchemaParser : public CharacterLevelParser
 {
 public:
+    // The schema is looked up in JsonSchemaRegistry::get_global(), and only parsed the first time it is seen
     JsonSchemaParser(const std::string &schema_string, CharacterLevelParserConfig *config);
 
     ~JsonSchemaParser() 
@@ -23,21 +172,36 @@ public:
         // std::cout << "JsonSchemaParser destructor called" << std::endl;
     }
     CharacterLevelParserPtr add_character(char new_character);
+    CharacterLevelParserPtr add_string(std::string_view characters) override;
 
-    std::string get_allowed_characters() const;
+    CharacterSet get_allowed_character_set() const override;
 
     virtual bool can_end() const;
 
+    ShortcutKey shortcut_key() const override;
+    std::size_t cache_key() const override;
+    bool cache_equals(const CharacterLevelParser& other) const override;
+
 
 public:
     struct _Context {
         Schema model_class;
-        JsonSchemaParser* active_parser;
+        // model_class, compiled
+        const CompiledSchema* root_schema;
+        std::vector<std::unique_ptr<CompiledSchema>> compiled_schemas;
+        // Characters that continue a JSON string without ending it
         std::string alphabet_without_quotes;
+        // alphabet_without_quotes and the backslash that starts an escape sequence
+        CharacterSet string_characters;
     };
-    typedef std::shared_ptr<_Context> ContextPtr;
+    // Contexts are immutable once created, and shared by every parser of the same schema
+    typedef std::shared_ptr<const _Context> ContextPtr;
+
+    JsonSchemaParser(ContextPtr context, CharacterLevelParserConfig *config);
+    // Parses and compiles a schema. An empty schema accepts any JSON value.
+    static ContextPtr create_context(const json& schema_json);
 
-    std::vector<CharacterLevelParserPtr> object_stack;
+    ParserStack object_stack;
     ContextPtr context;
     CharacterLevelParserConfig* config;
     int num_consecutive_whitespaces;
@@ -45,10 +209,46 @@ public:
     std::string last_non_whitespace_character;
 
 protected:
-     JsonSchemaParser(ContextPtr context, CharacterLevelParserConfig* config, const std::vector<CharacterLevelParserPtr>& updated_stack, int num_consecutive_whitespaces) 
+     CharacterSet _compute_allowed_character_set() const;
+     std::size_t _get_contents_run_length(std::string_view characters) const;
+     CharacterLevelParserPtr _add_contents_run(std::string_view characters);
+
+     mutable std::once_flag allowed_characters_once;
+     mutable CharacterSet allowed_characters;
+
+     JsonSchemaParser(ContextPtr context, CharacterLevelParserConfig* config, const ParserStack& updated_stack, int num_consecutive_whitespaces) 
      : context(context), config(config), object_stack(updated_stack), num_consecutive_whitespaces(num_consecutive_whitespaces) {
 
      }
 };
 
+// Compiled schemas shared by all the parsers of the process, so that creating a parser for a schema that was seen before
+// costs no parsing. Schemas are keyed by their text, and by their canonical form (parsed and dumped again, which sorts the
+// keys and drops whitespace) so that reformatted copies of a schema share one context. Once there are more than
+// max_entries contexts, the least recently used ones that no parser holds anymore are dropped. Thread safe.
+class JsonSchemaRegistry {
+public:
+    static const std::size_t DEFAULT_MAX_ENTRIES = 256;
+
+    explicit JsonSchemaRegistry(std::size_t max_entries = DEFAULT_MAX_ENTRIES);
 
+    // Throws like JsonSchemaParser if the schema is not valid JSON
+    JsonSchemaParser::ContextPtr get_context(const std::string& schema_string);
+
+    // 0 means unlimited
+    void set_max_entries(std::size_t max_entries);
+    void clear();
+    // The number of contexts held
+    std::size_t size();
+
+    static JsonSchemaRegistry& get_global();
+
+private:
+    void evict();
+
+    std::mutex mutex;
+    // By canonical schema string
+    LRUCache<std::string, JsonSchemaParser::ContextPtr> contexts;
+    // Schema string as given to its canonical form, for the lookups that skip parsing
+    LRUCache<std::string, std::string> canonical_strings;
+};
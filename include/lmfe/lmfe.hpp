@@ -1,8 +1,13 @@
 #pragma once
 
+#include "./characterset.hpp"
 #include "./characterlevelparser.hpp"
 #include "./jsonschemaparser.hpp"
 #include "./tokenenforcer.hpp"
+#include "./tokenbitmask.hpp"
+#include "./tokenmask.hpp"
+#include "./logitsmasking.hpp"
+#include "./executor.hpp"
 #include "./exceptions.hpp"
 
 
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "./tokenbitmask.hpp"
+#include "./tokenmask.hpp"
+
+// In-place logit masking: every logit whose token is not set in the bitmask is replaced with -inf.
+// Logits past the end of the bitmask (e.g. a model vocabulary padded beyond the tokenizer's) are masked as well.
+// The implementation is picked at runtime (AVX-512, AVX2 or scalar) based on what the CPU supports.
+
+enum class LogitsMaskingImplementation {
+    AUTO,
+    SCALAR,
+    AVX2,
+    AVX512
+};
+
+// Forces a specific implementation (mostly useful for benchmarks and tests). Requests that the CPU
+// does not support fall back to the best supported one. Returns the implementation that will be used.
+LogitsMaskingImplementation select_logits_masking_implementation(LogitsMaskingImplementation requested);
+LogitsMaskingImplementation get_logits_masking_implementation();
+
+void apply_token_bitmask_inplace(float* logits, std::size_t num_logits, const TokenBitmask::Word* bitmask, std::size_t bitmask_bits);
+// fp16 / bf16 logits are passed as their raw 16 bit patterns
+void apply_token_bitmask_inplace_fp16(uint16_t* logits, std::size_t num_logits, const TokenBitmask::Word* bitmask, std::size_t bitmask_bits);
+void apply_token_bitmask_inplace_bf16(uint16_t* logits, std::size_t num_logits, const TokenBitmask::Word* bitmask, std::size_t bitmask_bits);
+
+inline void apply_token_bitmask_inplace(float* logits, std::size_t num_logits, const TokenBitmask& bitmask) {
+    apply_token_bitmask_inplace(logits, num_logits, bitmask.data(), bitmask.size());
+}
+
+inline void apply_token_bitmask_inplace_fp16(uint16_t* logits, std::size_t num_logits, const TokenBitmask& bitmask) {
+    apply_token_bitmask_inplace_fp16(logits, num_logits, bitmask.data(), bitmask.size());
+}
+
+inline void apply_token_bitmask_inplace_bf16(uint16_t* logits, std::size_t num_logits, const TokenBitmask& bitmask) {
+    apply_token_bitmask_inplace_bf16(logits, num_logits, bitmask.data(), bitmask.size());
+}
+
+// Applies a TokenMask in the form it is stored in: a deny list only touches the listed logits,
+// an allow list fills the gaps between the allowed ids, and a dense mask goes through the bitmask kernel.
+void apply_token_mask_inplace(float* logits, std::size_t num_logits, const TokenMask& mask);
+void apply_token_mask_inplace_fp16(uint16_t* logits, std::size_t num_logits, const TokenMask& mask);
+void apply_token_mask_inplace_bf16(uint16_t* logits, std::size_t num_logits, const TokenMask& mask);
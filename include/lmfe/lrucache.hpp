@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <unordered_map>
+
+// A map with a budget on the number of entries and on their total (caller estimated) size.
+// Entries are kept in least recently used order, evict() drops the oldest ones until the cache fits its budget.
+// Not thread safe.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class LRUCache {
+public:
+    // 0 means unlimited
+    explicit LRUCache(std::size_t max_entries = 0, std::size_t max_total_size = 0)
+        : max_entries(max_entries), max_total_size(max_total_size), total_size(0) {}
+
+    void set_limits(std::size_t max_entries, std::size_t max_total_size) {
+        this->max_entries = max_entries;
+        this->max_total_size = max_total_size;
+    }
+
+    // Returns nullptr if missing, otherwise marks the entry as most recently used
+    Value* get(const Key& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        recency.splice(recency.begin(), recency, it->second.recency_it);
+        return &it->second.value;
+    }
+
+    // Inserts or replaces the entry and marks it as most recently used. Does not evict, see evict().
+    void put(const Key& key, Value value, std::size_t size) {
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            total_size -= it->second.size;
+            it->second.value = std::move(value);
+            it->second.size = size;
+            recency.splice(recency.begin(), recency, it->second.recency_it);
+        } else {
+            it = entries.emplace(key, Entry{std::move(value), size, recency.end()}).first;
+            // unordered_map nodes never move, so the list can point at the stored key
+            recency.push_front(&it->first);
+            it->second.recency_it = recency.begin();
+        }
+        total_size += size;
+    }
+
+    // Updates the size of an existing entry, e.g. after its value grew. Does not evict or change its recency.
+    bool resize(const Key& key, std::size_t size) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        total_size = total_size - it->second.size + size;
+        it->second.size = size;
+        return true;
+    }
+
+    bool erase(const Key& key) {
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        total_size -= it->second.size;
+        recency.erase(it->second.recency_it);
+        entries.erase(it);
+        return true;
+    }
+
+    // Evicts least recently used entries until the budget is met. Entries for which can_evict(key, value)
+    // returns false are skipped, so the cache can stay over budget if too many of them are pinned.
+    template <typename Predicate>
+    void evict(Predicate can_evict) {
+        auto it = recency.end();
+        while (is_over_budget() && it != recency.begin()) {
+            --it;
+            auto entry_it = entries.find(**it);
+            if (!can_evict(entry_it->first, entry_it->second.value)) {
+                continue;
+            }
+            total_size -= entry_it->second.size;
+            it = recency.erase(it);
+            entries.erase(entry_it);
+        }
+    }
+
+    void clear() {
+        entries.clear();
+        recency.clear();
+        total_size = 0;
+    }
+
+    std::size_t size() const { return entries.size(); }
+    std::size_t get_total_size() const { return total_size; }
+
+private:
+    struct Entry {
+        Value value;
+        std::size_t size;
+        typename std::list<const Key*>::iterator recency_it;
+    };
+
+    bool is_over_budget() const {
+        return (max_entries != 0 && entries.size() > max_entries) ||
+               (max_total_size != 0 && total_size > max_total_size);
+    }
+
+    std::unordered_map<Key, Entry, Hash> entries;
+    // Most recently used first
+    std::list<const Key*> recency;
+    std::size_t max_entries;
+    std::size_t max_total_size;
+    std::size_t total_size;
+};
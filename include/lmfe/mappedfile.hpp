@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A read only view of a whole file. The file is mapped into memory on POSIX systems, so pages are only read when they are
+// touched. Elsewhere it is read into a buffer. Either way the contents can be used in place until the object is destroyed.
+class MappedFile {
+public:
+    // Throws LMFormatEnforcerException if the file cannot be opened or read
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return file_data; }
+    std::size_t size() const { return file_size; }
+
+private:
+    const char* file_data;
+    std::size_t file_size;
+    bool is_mapped;
+    // Holds the contents when the file is not mapped
+    std::vector<char> buffer;
+};
+
+// A fast 64 bit checksum for detecting stale or damaged files. Not suitable against deliberate tampering.
+uint64_t checksum64(const void* data, std::size_t size, uint64_t seed = 0);
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+// A packed set of token ids, one bit per vocabulary entry.
+// Token i is bit (i % 32) of word (i / 32), which is the layout that logit masking code
+// (and most inference engines) consume directly, so callers can copy or OR whole words.
+class TokenBitmask {
+public:
+    typedef uint32_t Word;
+    static const int BITS_PER_WORD = 32;
+
+    TokenBitmask() : num_bits(0) {}
+    explicit TokenBitmask(std::size_t num_bits) : num_bits(num_bits), words(num_words(num_bits), 0) {}
+
+    static std::size_t num_words(std::size_t num_bits) {
+        return (num_bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    }
+
+    static int popcount(Word word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcount(word);
+#else
+        int count = 0;
+        for (; word; word &= word - 1) {
+            count++;
+        }
+        return count;
+#endif
+    }
+
+    static int count_trailing_zeros(Word word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(word);
+#else
+        int count = 0;
+        while (!(word & 1)) {
+            word >>= 1;
+            count++;
+        }
+        return count;
+#endif
+    }
+
+    std::size_t size() const { return num_bits; }
+    std::size_t word_count() const { return words.size(); }
+    const Word* data() const { return words.data(); }
+    Word* data() { return words.data(); }
+
+    void set(int token_id) {
+        words[token_id / BITS_PER_WORD] |= Word(1) << (token_id % BITS_PER_WORD);
+    }
+
+    void reset(int token_id) {
+        words[token_id / BITS_PER_WORD] &= ~(Word(1) << (token_id % BITS_PER_WORD));
+    }
+
+    bool test(int token_id) const {
+        if (token_id < 0 || static_cast<std::size_t>(token_id) >= num_bits) {
+            return false;
+        }
+        return (words[token_id / BITS_PER_WORD] >> (token_id % BITS_PER_WORD)) & 1;
+    }
+
+    // Sets bits [begin, end), whole words at a time
+    void set_range(std::size_t begin, std::size_t end) {
+        if (begin >= end) {
+            return;
+        }
+        std::size_t first_word = begin / BITS_PER_WORD;
+        std::size_t last_word = (end - 1) / BITS_PER_WORD;
+        Word first_mask = ~Word(0) << (begin % BITS_PER_WORD);
+        Word last_mask = ~Word(0) >> (BITS_PER_WORD - 1 - (end - 1) % BITS_PER_WORD);
+        if (first_word == last_word) {
+            words[first_word] |= first_mask & last_mask;
+            return;
+        }
+        words[first_word] |= first_mask;
+        std::fill(words.begin() + first_word + 1, words.begin() + last_word, ~Word(0));
+        words[last_word] |= last_mask;
+    }
+
+    void clear() {
+        std::fill(words.begin(), words.end(), 0);
+    }
+
+    bool none() const {
+        for (Word word : words) {
+            if (word) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::size_t count() const {
+        std::size_t total = 0;
+        for (Word word : words) {
+            total += popcount(word);
+        }
+        return total;
+    }
+
+    // Writes word_count() words to destination
+    void copy_to(Word* destination) const {
+        std::copy(words.begin(), words.end(), destination);
+    }
+
+    // ORs word_count() words into destination
+    void or_into(Word* destination) const {
+        for (std::size_t i = 0; i < words.size(); ++i) {
+            destination[i] |= words[i];
+        }
+    }
+
+    std::vector<int> to_token_list() const {
+        std::vector<int> token_ids;
+        token_ids.reserve(count());
+        for (std::size_t word_idx = 0; word_idx < words.size(); ++word_idx) {
+            Word word = words[word_idx];
+            while (word) {
+                token_ids.push_back(static_cast<int>(word_idx * BITS_PER_WORD + count_trailing_zeros(word)));
+                word &= word - 1;
+            }
+        }
+        return token_ids;
+    }
+
+private:
+    std::size_t num_bits;
+    std::vector<Word> words;
+};
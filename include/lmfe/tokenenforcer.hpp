@@ -1,9 +1,14 @@
 #pragma once
 
+#include <chrono>
+#include <future>
 #include <vector>
-#include <set>
 #include "./characterlevelparser.hpp"
 #include "./tokenizerdata.hpp"
+#include "./tokenbitmask.hpp"
+#include "./tokenmask.hpp"
+#include "./executor.hpp"
+#include "./lrucache.hpp"
 #include "./exceptions.hpp"
 
 //https://stackoverflow.com/a/53283994/1075114
@@ -19,156 +24,509 @@ struct VectorHasher {
 
 typedef const std::vector<int> FrozenTokenVector;
 
+class TokenEnforcerCursor;
+
+// Characters that every allowed continuation of a state starts with, see TokenEnforcer::get_forced_continuation()
+struct ForcedContinuation {
+    std::string characters;
+    // A tokenization of characters (greedy longest match, not necessarily the one the tokenizer would produce).
+    // Appending the tokens one by one keeps the sequence allowed.
+    std::vector<int> token_ids;
+};
+
 class TokenEnforcer
 {
 public:
     struct OutputTensorState {
         CharacterLevelParserPtr parser;
+        // Stored in its most compact form (allow list, deny list or dense bitmask).
+        // Null for states that were only reached through filter_allowed_candidates() / get_forced_continuation().
+        TokenMaskPtr allowed_tokens_mask;
+        // False when allowed_tokens_mask is shared through the tokenizer data's AllowedTokenCache, which accounts for it
+        bool owns_allowed_tokens_mask = false;
+        // Materialized from allowed_tokens_mask the first time get_allowed_tokens() / get_allowed_tokens_bitmask()
+        // asks for this state in a form that differs from the compact one
         std::vector<int> allowed_tokens;
+        TokenBitmask allowed_tokens_bitmask;
         std::vector<int> current_word_tokens;
     };
+    typedef std::shared_ptr<OutputTensorState> OutputTensorStatePtr;
 
-    TokenEnforcer(TokenEnforcerTokenizerData* tokenizer_data, CharacterLevelParserPtr parser): tokenizer_data(tokenizer_data), root_parser(parser) {
+    TokenEnforcer(TokenEnforcerTokenizerData* tokenizer_data, CharacterLevelParserPtr parser): prefix_states(0, DEFAULT_MAX_CACHED_STATES_MEMORY), tokenizer_data(tokenizer_data), root_parser(parser), min_parallel_tokens(0) {
         
     }
 
+    static const std::size_t DEFAULT_MAX_CACHED_STATES_MEMORY = 256 * 1024 * 1024;
+
+    // Bounds the states kept for the get_allowed_tokens*() family (0 means unlimited). When over budget, the least recently
+    // used states are dropped, except those still held by a TokenEnforcerCursor. A sequence is only recognized as a
+    // continuation while the state of its previous step is cached, so the budget should comfortably exceed the number of
+    // sequences being generated at the same time. Memory is an estimate of what the states own: their keys, and the masks,
+    // token lists and bitmasks they materialize, except masks shared through the AllowedTokenCache (which has its own budget).
+    // A state is charged again whenever it materializes one of them, so references returned by get_allowed_tokens*()
+    // stay valid until the next call to the enforcer.
+    void set_state_cache_limits(std::size_t max_states, std::size_t max_memory_bytes) {
+        prefix_states.set_limits(max_states, max_memory_bytes);
+        _evict_states();
+    }
+
+    // Drops the cached state of a finished sequence (e.g. a beam that was pruned or completed).
+    // Its earlier prefixes are left for LRU eviction, since other beams may still be extending them.
+    void release(FrozenTokenVector& token_sequence) {
+        prefix_states.erase(token_sequence);
+    }
+
+    std::size_t get_num_cached_states() const {
+        return prefix_states.size();
+    }
+
+    // The estimated memory of the cached states, see set_state_cache_limits()
+    std::size_t get_cached_states_memory() const {
+        return prefix_states.get_total_size();
+    }
+
+    // Splits the tokenizer tree walk of permissive states (e.g. free text inside a string) across the executor's threads.
+    // States whose allowed subtrees contain fewer than min_parallel_tokens tokens are still walked on the calling thread.
+    // The executor can be shared between enforcers, or be an adapter over the host's own thread pool.
+    void set_executor(TokenEnforcerExecutorPtr executor, std::size_t min_parallel_tokens = 8192) {
+        this->executor = executor;
+        this->min_parallel_tokens = min_parallel_tokens;
+    }
+
     FrozenTokenVector& get_allowed_tokens(FrozenTokenVector token_sequence) {
-        FrozenTokenVector sent_tuple(token_sequence.begin(), token_sequence.end());
-        FrozenTokenVector prev_step_tuple(token_sequence.begin(), token_sequence.end() - 1);
+        OutputTensorState* state = _get_state(token_sequence.data(), token_sequence.size());
+        if (state->allowed_tokens_mask->get_kind() == TokenMask::Kind::ALLOW_LIST) {
+            return state->allowed_tokens_mask->get_token_ids();
+        }
+        if (state->allowed_tokens.empty()) {
+            state->allowed_tokens = state->allowed_tokens_mask->to_token_list();
+            _update_state_memory(token_sequence, state);
+        }
+        return state->allowed_tokens;
+    }
 
-        if (prefix_states.count(sent_tuple) > 0) {
-            return prefix_states[sent_tuple]->allowed_tokens;
-        } else if (prefix_states.count(prev_step_tuple) == 0) {
-            OutputTensorState* state = new OutputTensorState();
-            state->parser = root_parser;
-            prefix_states[sent_tuple] = state;
-            _compute_allowed_tokens(sent_tuple, state);
-            return state->allowed_tokens;
-        } else {
-            OutputTensorState* prev_step_state = prefix_states[prev_step_tuple];
-            OutputTensorState* new_state = _apply_new_characters(prev_step_state, token_sequence);
-            prefix_states[sent_tuple] = new_state;
-            _compute_allowed_tokens(sent_tuple, new_state);
-            return new_state->allowed_tokens;
+    // Same as get_allowed_tokens(), as a packed bitset of tokenizer_data->vocab_size bits.
+    // The bitmask is cached per state, so callers can copy or OR its words without walking an id list.
+    const TokenBitmask& get_allowed_tokens_bitmask(FrozenTokenVector& token_sequence) {
+        OutputTensorState* state = _get_state(token_sequence.data(), token_sequence.size());
+        if (state->allowed_tokens_mask->get_kind() == TokenMask::Kind::BITMASK) {
+            return state->allowed_tokens_mask->get_bitmask();
         }
+        if (state->allowed_tokens_bitmask.size() == 0) {
+            state->allowed_tokens_bitmask = state->allowed_tokens_mask->to_bitmask();
+            _update_state_memory(token_sequence, state);
+        }
+        return state->allowed_tokens_bitmask;
+    }
+
+    // Same as get_allowed_tokens(), in the form the enforcer stores it (see TokenMask).
+    // A state that allows almost everything is a short deny list, which is the cheapest to keep and to apply.
+    const TokenMask& get_allowed_tokens_mask(FrozenTokenVector& token_sequence) {
+        return *_get_state(token_sequence.data(), token_sequence.size())->allowed_tokens_mask;
     }
 
+    // Computes the allowed tokens of a whole decoding batch in one call, instead of one get_allowed_tokens() per sequence.
+    // Sequence i is token_ids[offsets[i]..offsets[i + 1]) and is evaluated by enforcers[i] (the same enforcer can appear
+    // in several rows, e.g. for beams). Its bitmask is written to row i of the caller owned output matrix, whose rows are
+    // output_row_words words apart and must hold at least TokenBitmask::num_words(vocab_size) words. Extra words are zeroed.
+    // Each row is still looked up like get_allowed_tokens(), so its history is copied and hashed, and a row that reaches
+    // a new state allocates the state and its key. The tokenizer tree walks of such rows share their scratch bitmasks.
+    static void get_allowed_tokens_batch(TokenEnforcer* const* enforcers,
+                                         std::size_t batch_size,
+                                         const int* token_ids,
+                                         const std::size_t* offsets,
+                                         TokenBitmask::Word* output,
+                                         std::size_t output_row_words);
+
+    // Same as above, for sequences tracked by cursors (see start_sequence()). Their states are already known, so no
+    // history is copied or looked up and nothing is allocated. Waits for pending TokenEnforcerCursor::advance_async() calls.
+    static void get_allowed_tokens_batch(const TokenEnforcerCursor* const* cursors,
+                                         std::size_t batch_size,
+                                         TokenBitmask::Word* output,
+                                         std::size_t output_row_words);
+
+    // Checks draft tokens (e.g. from a speculative decoding draft model) against the grammar in one pass.
+    // Returns how many leading draft tokens are allowed. Row i of the output matrix (laid out as in get_allowed_tokens_batch())
+    // gets the bitmask of tokens allowed after prefix + draft_tokens[0..i), for i up to the returned count, which includes
+    // the mask for the token after the accepted draft. Later rows are zeroed. The state after every accepted draft token
+    // is cached, so get_allowed_tokens() continues from whichever of them the target model accepts without replaying it.
+    // output must have room for num_draft_tokens + 1 rows.
+    std::size_t verify_draft(FrozenTokenVector& prefix,
+                             const int* draft_tokens,
+                             std::size_t num_draft_tokens,
+                             TokenBitmask::Word* output,
+                             std::size_t output_row_words);
+
+    // Checks a tree of candidate tokens (e.g. Medusa / EAGLE style tree speculation) against the grammar.
+    // Node i proposes tree_tokens[i] after its parent node parent_indices[i], or right after prefix when it is -1.
+    // Parents must come before their children. node_allowed[i] tells whether the path to node i is allowed, and row i of
+    // the output matrix gets the bitmask of tokens allowed after that path (zeroed for disallowed nodes). Sibling branches
+    // share the parser states of their common ancestors, and nodes below a disallowed node are not evaluated.
+    // The states of all allowed nodes are cached, so get_allowed_tokens() continues from whichever path is accepted.
+    void verify_tree(FrozenTokenVector& prefix,
+                     const int* tree_tokens,
+                     const int* parent_indices,
+                     std::size_t num_nodes,
+                     bool* node_allowed,
+                     TokenBitmask::Word* output,
+                     std::size_t output_row_words);
+
+    // Returns the longest string that every allowed continuation of token_sequence starts with, and tokens that spell it,
+    // so they can be appended in a single prefill instead of a decode step each (e.g. the rest of a key, or of "true").
+    // The string stops where the parser offers a choice, including ending the sequence. With ignore_whitespace, optional
+    // whitespace does not count as a choice, so e.g. the ':' after a key is forced as well. The characters are cut where
+    // the tokenizer has no token to continue with, so that they always match token_ids.
+    ForcedContinuation get_forced_continuation(FrozenTokenVector& token_sequence, bool ignore_whitespace = false) {
+        return _get_forced_continuation(_get_state(token_sequence.data(), token_sequence.size(), false)->parser, ignore_whitespace);
+    }
+
+    // Returns the first max_allowed candidates (in the given order, e.g. sorted by logit) that are allowed after
+    // token_sequence. Unless the state's mask is already known, each candidate is checked by feeding its characters to
+    // the parser, which for a permissive state is far cheaper than computing the full mask. Only when every candidate is
+    // rejected is the full mask computed, so that a following get_allowed_tokens() call is ready to resample from.
+    std::vector<int> filter_allowed_candidates(FrozenTokenVector& token_sequence, const std::vector<int>& candidates, std::size_t max_allowed = 1);
+
+    // Starts tracking a single generated sequence. The cursor is advanced with each generated token and returns the
+    // next allowed tokens in O(1) with respect to the sequence length, since it never copies, hashes or looks up the
+    // token history. The prompt itself does not affect the parser, only the tokens passed to advance() do.
+    TokenEnforcerCursor start_sequence();
+
 private:
-    std::unordered_map<FrozenTokenVector, OutputTensorState*, VectorHasher> prefix_states;
+    friend class TokenEnforcerCursor;
+
+    LRUCache<std::vector<int>, OutputTensorStatePtr, VectorHasher> prefix_states;
+    // The state before any output token, shared by every prompt and cursor
+    OutputTensorStatePtr root_state;
     CharacterLevelParserPtr root_parser;
     TokenEnforcerTokenizerData* tokenizer_data;
+    TokenEnforcerExecutorPtr executor;
+    std::size_t min_parallel_tokens;
     // Other member variables
+    // Reused for prefix_states lookups, so that probing the map does not allocate a key per call
+    std::vector<int> lookup_key;
+
+    // The bitmasks a tokenizer tree walk fills. A walk without one (see _compute_allowed_tokens()) allocates its own.
+    struct WalkScratch {
+        TokenBitmask allowed_tokens;
+        TokenBitmask allowed_tree_tokens;
+    };
+
+    // Without compute_mask, a new state only gets its parser and allowed_tokens_mask stays null until a later call needs it
+    OutputTensorState* _get_state(const int* token_sequence, std::size_t num_tokens, bool compute_mask = true, WalkScratch* scratch = nullptr) {
+        lookup_key.assign(token_sequence, token_sequence + num_tokens);
+        OutputTensorStatePtr* cached_state = prefix_states.get(lookup_key);
+        if (cached_state != nullptr) {
+            OutputTensorState* state = cached_state->get();
+            if (compute_mask && !state->allowed_tokens_mask) {
+                _compute_allowed_tokens(&lookup_key, state, scratch);
+                _update_state_memory(lookup_key, state);
+            }
+            return state;
+        }
+        lookup_key.pop_back();
+        OutputTensorStatePtr* prev_step_state = prefix_states.get(lookup_key);
+        lookup_key.push_back(token_sequence[num_tokens - 1]);
+        OutputTensorStatePtr new_state;
+        if (prev_step_state == nullptr) {
+            new_state = _get_root_state(lookup_key);
+        } else {
+            new_state = _apply_new_characters(prev_step_state->get(), lookup_key.back());
+            if (compute_mask) {
+                _compute_allowed_tokens(&lookup_key, new_state.get(), scratch);
+            }
+        }
+        prefix_states.put(lookup_key, new_state, _estimate_state_memory(lookup_key, new_state.get()));
+        // Kept even if it alone exceeds the budget, until the caller is done with it
+        _evict_states(new_state.get());
+        return new_state.get();
+    }
+
+    // Evicts down to the budget, never dropping keep_state (the state the caller is about to return)
+    void _evict_states(const OutputTensorState* keep_state = nullptr) {
+        const OutputTensorState* root = root_state.get();
+        prefix_states.evict([root, keep_state](const std::vector<int>&, const OutputTensorStatePtr& state) {
+            // Any other reference is a live cursor. The root state is shared by every prompt and kept by root_state anyway.
+            return (state.use_count() == 1 || state.get() == root) && state.get() != keep_state;
+        });
+    }
+
+    // Charges a cached state again once it computed its mask or materialized its token list or bitmask
+    void _update_state_memory(FrozenTokenVector& token_sequence, const OutputTensorState* state) {
+        prefix_states.resize(token_sequence, _estimate_state_memory(token_sequence, state));
+        _evict_states(state);
+    }
+
+    std::size_t _estimate_state_memory(FrozenTokenVector& token_sequence, const OutputTensorState* state) const {
+        std::size_t memory = sizeof(OutputTensorState) + token_sequence.size() * sizeof(int) + state->current_word_tokens.size() * sizeof(int);
+        // The root state is shared by every prompt, so its entries only own their keys
+        if (state == root_state.get()) {
+            return memory;
+        }
+        if (state->allowed_tokens_mask && state->owns_allowed_tokens_mask) {
+            memory += sizeof(TokenMask) + state->allowed_tokens_mask->memory_size();
+        }
+        memory += state->allowed_tokens.capacity() * sizeof(int) + state->allowed_tokens_bitmask.word_count() * sizeof(TokenBitmask::Word);
+        return memory;
+    }
+
+    ForcedContinuation _get_forced_continuation(CharacterLevelParserPtr parser, bool ignore_whitespace) const;
+    bool _is_token_allowed(CharacterLevelParserPtr parser, int token_id) const;
 
-    TokenEnforcer::OutputTensorState* _apply_new_characters(OutputTensorState* state, FrozenTokenVector& token_sequence) {
-        TokenEnforcer::OutputTensorState* new_state = new TokenEnforcer::OutputTensorState();
+    OutputTensorStatePtr _get_root_state(FrozenTokenVector& state_tokens) {
+        if (!root_state) {
+            OutputTensorStatePtr state = std::make_shared<OutputTensorState>();
+            state->parser = root_parser;
+            _compute_allowed_tokens(&state_tokens, state.get());
+            root_state = state;
+        }
+        return root_state;
+    }
+
+    OutputTensorStatePtr _apply_new_characters(const OutputTensorState* state, int new_token) {
+        OutputTensorStatePtr new_state = std::make_shared<OutputTensorState>();
         new_state->parser = state->parser;
-        TokenizerPrefixTree* tokenizer_tree = tokenizer_data->tokenizer_tree;
-        int new_token = token_sequence.back();
-        std::string new_characters;
-        if (std::find(tokenizer_tree->new_word_tokens.begin(), tokenizer_tree->new_word_tokens.end(), new_token) != tokenizer_tree->new_word_tokens.end())
+        std::string new_characters = _get_new_characters(state, new_token, new_state->current_word_tokens);
+        new_state->parser = new_state->parser->add_string(new_characters);
+        if (!new_state->parser)
         {
-            new_state->current_word_tokens = {new_token};
-            new_characters = tokenizer_tree->tokens_to_strs[new_token];
+            // This can happen in beam / batch scenarios, when some of the batches finished but others are continuing.
+            //logging.debug("Received an invalid character '" + character + "', switching to ForceStopParser");
+            new_state->parser = CharacterLevelParserPtr(new ForceStopParser());
         }
-        else
-        {
-            new_state->current_word_tokens = state->current_word_tokens;
-            new_state->current_word_tokens.push_back(new_token);
-            std::string prev_decoded = tokenizer_data->decode(state->current_word_tokens);
-            std::string new_decoded = tokenizer_data->decode(new_state->current_word_tokens);
-            new_characters = new_decoded.substr(prev_decoded.length());
-        }
-        for (char character : new_characters) {
-            auto allowed_characters = new_state->parser->get_allowed_characters();
-            if (std::find(allowed_characters.begin(), allowed_characters.end(), character) != allowed_characters.end())
-            {
-                new_state->parser = new_state->parser->add_character(character);
-            }
-            else
-            {
-                // This can happen in beam / batch scenarios, when some of the batches finished but others are continuing.
-                //logging.debug("Received an invalid character '" + character + "', switching to ForceStopParser");
-                new_state->parser = CharacterLevelParserPtr(new ForceStopParser());
-                break;
+        return new_state;
+    }
+
+    // Only DECODE and VERIFY keep track of the current word, in new_word_tokens
+    std::string _get_new_characters(const OutputTensorState* state, int new_token, std::vector<int>& new_word_tokens) const {
+        const TokenizerPrefixTree* tokenizer_tree = tokenizer_data->tokenizer_tree;
+        IncrementalDecoding incremental_decoding = tokenizer_data->incremental_decoding;
+        if (incremental_decoding == IncrementalDecoding::TABLE) {
+            if (tokenizer_tree->is_regular_token(new_token)) {
+                return tokenizer_tree->get_token_string(new_token);
             }
+            return tokenizer_data->decode({new_token});
+        }
+        if (tokenizer_tree->is_new_word_token(new_token)) {
+            new_word_tokens = {new_token};
+            return tokenizer_tree->get_token_string(new_token);
         }
+        new_word_tokens = state->current_word_tokens;
+        new_word_tokens.push_back(new_token);
+        std::string prev_decoded = tokenizer_data->decode(state->current_word_tokens);
+        std::string new_decoded = tokenizer_data->decode(new_word_tokens);
+        std::string new_characters = new_decoded.substr(prev_decoded.length());
+        if (incremental_decoding == IncrementalDecoding::VERIFY && tokenizer_tree->is_regular_token(new_token) &&
+            tokenizer_tree->get_token_string(new_token) != new_characters) {
+            throw LMFormatEnforcerException("Token " + std::to_string(new_token) + " appends '" + new_characters +
+                                            "' when decoded, but its string is '" + tokenizer_tree->get_token_string(new_token) +
+                                            "'. Use IncrementalDecoding::DECODE with this tokenizer.");
+        }
+        return new_characters;
+    }
+
+    // Only reads the enforcer (the shared mask cache locks itself), so cursors may call it from other threads.
+    // state_tokens is the whole sequence up to and including new_token, or null when it is not known (cursors)
+    OutputTensorStatePtr _advance_state(const OutputTensorState* state, int new_token, FrozenTokenVector* state_tokens) {
+        OutputTensorStatePtr new_state = _apply_new_characters(state, new_token);
+        _compute_allowed_tokens(state_tokens, new_state.get());
         return new_state;
     }
 
-    void _collect_allowed_tokens(CharacterLevelParserPtr parser, TokenizerPrefixTreeNode* tree_node, std::vector<int>& allowed_tokens) {
-        allowed_tokens.insert(allowed_tokens.end(), tree_node->tokens.begin(), tree_node->tokens.end());
-        std::string allowed_characters = parser->get_allowed_characters();
-        std::set<char> allowed_characters_set(allowed_characters.begin(), allowed_characters.end());
+    // Subtrees with fewer tokens are cheaper to walk than to check with _accepts_subtree()
+    static const uint32_t MIN_SUBTREE_SIZE_TO_ACCEPT_WHOLE = 8;
 
-        
-        std::string characters_to_explore;
-        for (const auto& entry : tree_node->children) {
-            if (allowed_characters_set.find(entry.first) != allowed_characters_set.end()) {
-                characters_to_explore += entry.first;
+    // Collects in tree order, see TokenizerPrefixTree::map_tree_tokens()
+    void _collect_allowed_tokens(CharacterLevelParserPtr parser, uint32_t tree_node, TokenBitmask& allowed_tree_tokens) {
+        const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+        const TokenizerPrefixTreeNode& node = tokenizer_tree.nodes[tree_node];
+        if (node.subtree_size >= MIN_SUBTREE_SIZE_TO_ACCEPT_WHOLE && node.num_children != 0 && _accepts_subtree(parser, tree_node)) {
+            tokenizer_tree.add_subtree_tree_tokens(tree_node, allowed_tree_tokens);
+            return;
+        }
+        tokenizer_tree.add_node_tree_tokens(tree_node, allowed_tree_tokens);
+        if (node.num_children == 0) {
+            return;
+        }
+        CharacterSet allowed_characters = parser->get_allowed_character_set();
+        for (uint32_t child = node.first_child; child < node.first_child + node.num_children; ++child) {
+            char character = tokenizer_tree.node_characters[child];
+            if (allowed_characters.contains(character)) {
+                _collect_allowed_tokens(parser->add_character(character), child, allowed_tree_tokens);
             }
         }
-        
-        /*
-        if (shortcut_key.has_value() && std::get<0>(shortcut_key.value()) == "json_freetext") {
-            assert(std::get<shortcut_key.value().size() == 4);
-            std::tuple<std::string, int, int, int> shortcut = shortcut_key.value();
-            int cur_len = std::get<1>(shortcut);
-            int min_len = std::get<2>(shortcut);
-            int max_len = std::get<3>(shortcut);
-            auto cache = this->tokenizer_tree.json_freetext_tokens;
+    }
+
+    // Whether the parser's shortcut (e.g. inside a JSON string, after a token's opening '"') accepts every token below
+    // the node, so that the walk can take the subtree as one range instead of descending into it
+    bool _accepts_subtree(const CharacterLevelParserPtr& parser, uint32_t tree_node) {
+        ShortcutKey shortcut_key = parser->shortcut_key();
+        if (shortcut_key.kind != ShortcutKey::Kind::CHARACTER_CLASS) {
+            return false;
+        }
+        const CharacterClassTokenIndex& index = tokenizer_data->tokenizer_tree->get_character_class_index(
+            shortcut_key.character_class, shortcut_key.run_limited_characters, shortcut_key.max_run);
+        std::size_t max_allowed_length = shortcut_key.max_length == static_cast<std::size_t>(-1) ? static_cast<std::size_t>(-1) : shortcut_key.max_length - shortcut_key.cur_length;
+        return index.accepts_subtree(tree_node, max_allowed_length);
+    }
+
+    void _collect_allowed_tokens_parallel(CharacterLevelParserPtr parser, TokenBitmask& allowed_tree_tokens);
 
-            int min_remaining = std::min(cache.max_token_len, std::max(0, min_len - cur_len));
-            int max_allowed_len = std::min(cache.max_token_len, max_len - cur_len);
+    // Tokens that stay inside the shortcut's character class come from the index. The tree is only walked along the paths
+    // that leave the class, e.g. the '"' that ends a JSON string or the ',' after a number.
+    // The class tokens are ORed into allowed_tokens, the walked ones into allowed_tree_tokens
+    void _collect_character_class_tokens(CharacterLevelParserPtr parser, const ShortcutKey& shortcut_key, TokenBitmask& allowed_tokens, TokenBitmask& allowed_tree_tokens) {
+        const CharacterClassTokenIndex& index = tokenizer_data->tokenizer_tree->get_character_class_index(
+            shortcut_key.character_class, shortcut_key.run_limited_characters, shortcut_key.max_run);
+        std::size_t max_allowed_length = shortcut_key.max_length == static_cast<std::size_t>(-1) ? index.get_max_token_length() : shortcut_key.max_length - shortcut_key.cur_length;
+        index.collect_tokens_up_to_length(max_allowed_length, allowed_tokens);
+        // Tokens that decode to nothing sit on the root and are allowed in every state
+        tokenizer_data->tokenizer_tree->add_node_tree_tokens(TokenizerPrefixTree::ROOT, allowed_tree_tokens);
+        _collect_class_boundary_tokens(parser, TokenizerPrefixTree::ROOT, index, allowed_tree_tokens);
+    }
 
-            std::vector<int> allowed_tokens_cache = cache.lookup_allowed_tokens(min_remaining, max_allowed_len);
-            allowed_tokens.insert(allowed_tokens.end(), allowed_tokens_cache.begin(), allowed_tokens_cache.end());
-            characters_to_explore = std::set<char>{'"'}.intersection(characters_to_explore);
+    void _collect_class_boundary_tokens(CharacterLevelParserPtr parser, uint32_t tree_node, const CharacterClassTokenIndex& index, TokenBitmask& allowed_tree_tokens) {
+        const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+        const TokenizerPrefixTreeNode& node = tokenizer_tree.nodes[tree_node];
+        CharacterSet allowed_characters = parser->get_allowed_character_set();
+        for (uint32_t child = node.first_child; child < node.first_child + node.num_children; ++child) {
+            char character = tokenizer_tree.node_characters[child];
+            if (!allowed_characters.contains(character)) {
+                continue;
+            }
+            if (!index.is_class_character(character)) {
+                _collect_allowed_tokens(parser->add_character(character), child, allowed_tree_tokens);
+            } else if (index.leads_outside_class(child)) {
+                _collect_class_boundary_tokens(parser->add_character(character), child, index, allowed_tree_tokens);
+            }
         }
-        */
+    }
 
-        for (char character : characters_to_explore) {
-            CharacterLevelParserPtr next_parser = parser->add_character(character);
-            TokenizerPrefixTreeNode* next_tree_node = tree_node->children[character];
-            _collect_allowed_tokens(next_parser, next_tree_node, allowed_tokens);
+    // Clears the bitmask for reuse, or allocates it if it has a different size (or was moved into a TokenMask)
+    static void _reset_bitmask(TokenBitmask& bitmask, std::size_t num_bits) {
+        if (bitmask.size() == num_bits && bitmask.word_count() == TokenBitmask::num_words(num_bits)) {
+            bitmask.clear();
+        } else {
+            bitmask = TokenBitmask(num_bits);
         }
     }
 
-    void _compute_allowed_tokens(FrozenTokenVector& state_tokens, TokenEnforcer::OutputTensorState* state) {
+    // state_tokens is only used to report the prefix of unexpected errors, and is null when the sequence is not known
+    void _compute_allowed_tokens(FrozenTokenVector* state_tokens, TokenEnforcer::OutputTensorState* state, WalkScratch* scratch = nullptr) {
         try {
-            std::vector<int> allowed_tokens;
-            /*
-            auto cache_key = state.parser.cache_key();
-            if (cache_key != nullptr && allowed_token_cache.count(cache_key) > 0) {
-                state.allowed_tokens = allowed_token_cache[cache_key];
-                return;
+            std::size_t cache_key = state->parser->cache_key();
+            if (cache_key != 0) {
+                TokenMaskPtr cached_mask = tokenizer_data->allowed_token_cache.get(state->parser, cache_key);
+                if (cached_mask) {
+                    state->allowed_tokens_mask = cached_mask;
+                    state->owns_allowed_tokens_mask = false;
+                    return;
+                }
+            }
+            const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+            ShortcutKey shortcut_key = state->parser->shortcut_key();
+            WalkScratch local_scratch;
+            TokenBitmask& allowed_tokens = scratch ? scratch->allowed_tokens : local_scratch.allowed_tokens;
+            TokenBitmask& allowed_tree_tokens = scratch ? scratch->allowed_tree_tokens : local_scratch.allowed_tree_tokens;
+            _reset_bitmask(allowed_tokens, tokenizer_data->vocab_size);
+            _reset_bitmask(allowed_tree_tokens, tokenizer_tree.token_pool.size());
+            if (shortcut_key.kind == ShortcutKey::Kind::CHARACTER_CLASS) {
+                _collect_character_class_tokens(state->parser, shortcut_key, allowed_tokens, allowed_tree_tokens);
+            } else if (executor) {
+                _collect_allowed_tokens_parallel(state->parser, allowed_tree_tokens);
+            } else {
+                _collect_allowed_tokens(state->parser, TokenizerPrefixTree::ROOT, allowed_tree_tokens);
             }
-            auto shortcut_key = state.parser.shortcut_key();
-            */
-            _collect_allowed_tokens(state->parser, tokenizer_data->tokenizer_tree->root, allowed_tokens/*, shortcut_key*/);
+            tokenizer_tree.map_tree_tokens(allowed_tree_tokens, allowed_tokens);
             if (state->parser->can_end()) {
-                allowed_tokens.push_back(tokenizer_data->eos_token_id);
+                allowed_tokens.set(tokenizer_data->eos_token_id);
             }
-            if (allowed_tokens.empty()) {
+            if (allowed_tokens.none()) {
                 throw std::runtime_error("Parser reached state with no allowed tokens");
             }
-            state->allowed_tokens = allowed_tokens;
-            /*
-            if (cache_key != nullptr) {
-                allowed_token_cache[cache_key] = allowed_tokens;
+            state->allowed_tokens_mask = std::make_shared<TokenMask>(TokenMask::from_bitmask(std::move(allowed_tokens)));
+            state->owns_allowed_tokens_mask = cache_key == 0;
+            if (cache_key != 0) {
+                tokenizer_data->allowed_token_cache.put(state->parser, cache_key, state->allowed_tokens_mask);
             }
-            */
         } catch (const LMFormatEnforcerException& ex) {
             // Getting an LMFormatEnforcerException means that we know what the user did wrong,
             // and we can give a nice error message for them to fix.
             throw;
         } catch (const std::exception& ex) {
             // Other exceptions are potential bugs and should be reported
-            std::string prefix = tokenizer_data->decode(state_tokens);
+            std::string prefix = state_tokens ? tokenizer_data->decode(*state_tokens) : "<tracked by a TokenEnforcerCursor>";
             std::cerr << "Unknown LMFormatEnforcer Problem. Prefix: '" << prefix << "'" << std::endl
                       << "Terminating the parser. Please open an issue at" << std::endl
                       << "https://github.com/noamgat/lm-format-enforcer/issues with the prefix and "
                       << "CharacterLevelParser parameters" << std::endl;
-            state->allowed_tokens = { tokenizer_data->eos_token_id };
+            TokenBitmask eos_only(tokenizer_data->vocab_size);
+            eos_only.set(tokenizer_data->eos_token_id);
+            state->allowed_tokens_mask = std::make_shared<TokenMask>(TokenMask::from_bitmask(std::move(eos_only)));
+            state->owns_allowed_tokens_mask = true;
+        }
+    }
+};
+
+// A single generated sequence tracked by a TokenEnforcer, see TokenEnforcer::start_sequence().
+// Copying a cursor (e.g. when a beam forks) shares the current state, both copies can then advance independently.
+// The enforcer must outlive its cursors.
+class TokenEnforcerCursor {
+public:
+    // Waits for a pending advance_async()
+    const TokenMask& get_allowed_tokens_mask() const {
+        _wait_for_pending_state();
+        return *state->allowed_tokens_mask;
+    }
+
+    // Advances by one generated token and returns the tokens allowed after it
+    const TokenMask& advance(int token_id) {
+        _wait_for_pending_state();
+        state = enforcer->_advance_state(state.get(), token_id, nullptr);
+        return *state->allowed_tokens_mask;
+    }
+
+    // Starts advancing by token_id in the background and returns right away, so that the next mask is computed while
+    // the model runs its forward pass. Runs on the enforcer's executor (see TokenEnforcer::set_executor()), or on a
+    // thread of its own without one. Every other call waits for it to finish and rethrows its exception, if any.
+    // Cursors of the same enforcer may advance concurrently with each other and with the get_allowed_tokens*() family.
+    void advance_async(int token_id);
+
+    // True if there is no pending advance_async(), or it finished
+    bool is_ready() const {
+        return !pending_state.valid() ||
+               pending_state.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    CharacterLevelParserPtr get_parser() const {
+        _wait_for_pending_state();
+        return state->parser;
+    }
+
+    // See TokenEnforcer::get_forced_continuation(). Advance the cursor with the returned tokens to apply them.
+    ForcedContinuation get_forced_continuation(bool ignore_whitespace = false) const {
+        _wait_for_pending_state();
+        return enforcer->_get_forced_continuation(state->parser, ignore_whitespace);
+    }
+
+private:
+    friend class TokenEnforcer;
+
+    TokenEnforcerCursor(TokenEnforcer* enforcer, TokenEnforcer::OutputTensorStatePtr state) : enforcer(enforcer), state(state) {}
+
+    void _wait_for_pending_state() const {
+        if (pending_state.valid()) {
+            std::shared_future<TokenEnforcer::OutputTensorStatePtr> pending = std::move(pending_state);
+            pending_state = std::shared_future<TokenEnforcer::OutputTensorStatePtr>();
+            state = pending.get();
         }
     }
+
+    TokenEnforcer* enforcer;
+    // Both are replaced once a pending advance_async() is collected, which const accessors do as well
+    mutable TokenEnforcer::OutputTensorStatePtr state;
+    mutable std::shared_future<TokenEnforcer::OutputTensorStatePtr> pending_state;
 };
+
+inline TokenEnforcerCursor TokenEnforcer::start_sequence() {
+    return TokenEnforcerCursor(this, _get_root_state(FrozenTokenVector()));
+}
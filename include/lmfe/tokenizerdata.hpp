@@ -1,29 +1,243 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <functional>
-#include <unordered_map>
-#include <unordered_set>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include "./allowedtokencache.hpp"
+#include "./mappedfile.hpp"
+#include "./tokenbitmask.hpp"
 
-struct TokenizerPrefixTreeNode;
+// A read only array owned by someone else, e.g. a vector or a mapped file
+template <typename T>
+class ConstArrayView {
+public:
+    ConstArrayView() : pointer(nullptr), length(0) {}
+    ConstArrayView(const T* pointer, std::size_t length) : pointer(pointer), length(length) {}
+    ConstArrayView(const std::vector<T>& vector) : pointer(vector.data()), length(vector.size()) {}
+
+    const T& operator[](std::size_t index) const { return pointer[index]; }
+    const T* data() const { return pointer; }
+    std::size_t size() const { return length; }
+    const T* begin() const { return pointer; }
+    const T* end() const { return pointer + length; }
+
+private:
+    const T* pointer;
+    std::size_t length;
+};
 
+// A node of TokenizerPrefixTree. Nodes are stored in one array in BFS order, so the children of a node are a
+// contiguous range of it (sorted by character). The token pool is in DFS order: token_pool[first_token, + num_tokens)
+// are the tokens of the node itself, and token_pool[first_token, + subtree_size) those of its whole subtree.
 struct TokenizerPrefixTreeNode
 {
-    std::vector<int> tokens;
-    std::unordered_map<char, TokenizerPrefixTreeNode*> children;
+    uint32_t first_child;
+    uint32_t num_children;
+    uint32_t first_token;
+    uint32_t num_tokens;
+    // Number of tokens in this node and all of its descendants
+    uint32_t subtree_size;
+};
+
+class TokenizerPrefixTree;
+
+// What the hot paths need to know about a token, in one id-indexed table (see TokenizerPrefixTree::token_infos)
+struct TokenInfo
+{
+    // Bits of flags
+    static const uint8_t REGULAR = 1;
+    static const uint8_t NEW_WORD = 2;
+    // Character classes of the string, only set for non empty strings
+    static const uint8_t DIGITS_ONLY = 4;
+    static const uint8_t WHITESPACE_ONLY = 8;
+    static const uint8_t CONTAINS_QUOTE = 16;
+    static const uint8_t CONTAINS_BACKSLASH = 32;
+
+    // The string is token_string_blob[string_offset, string_offset + string_length)
+    uint32_t string_offset = 0;
+    uint32_t string_length = 0;
+    // The tree node the string ends at
+    uint32_t tree_node = 0;
+    uint8_t flags = 0;
+    // '\0' for empty strings
+    char first_character = '\0';
+    uint8_t padding[2] = {0, 0};
+};
+
+// Splits the vocabulary by a character class (see ShortcutKey::CHARACTER_CLASS):
+// - tokens made only of class characters, indexed by their length. Tokens with a run of run_limited_characters longer
+//   than max_run are left out, e.g. whitespace inside a JSON string.
+// - tokens that contain a character outside of the class, represented by the tree nodes on the way to them, so that
+//   a tree walk can skip every subtree that stays inside the class.
+class CharacterClassTokenIndex {
+public:
+    CharacterClassTokenIndex(const TokenizerPrefixTree& tokenizer_tree,
+                             const std::string& class_characters,
+                             const std::string& run_limited_characters,
+                             std::size_t max_run);
+
+    // ORs the class tokens that are at most max_length characters long into allowed_tokens
+    void collect_tokens_up_to_length(std::size_t max_length, TokenBitmask& allowed_tokens) const;
+
+    std::size_t get_max_token_length() const { return tokens_up_to_length.size() - 1; }
+
+    bool is_class_character(char character) const { return class_characters[static_cast<unsigned char>(character)]; }
+
+    // Whether a token below tree_node (reached through class characters) leaves the class
+    bool leads_outside_class(uint32_t tree_node) const {
+        return nodes_leading_outside_class[tree_node];
+    }
+
+    // Whether every path below tree_node (read from tree_node on, so the characters above it do not matter) stays in the
+    // class, has no run longer than max_run and is at most max_length characters long. A parser with this shortcut then
+    // accepts the node's whole subtree.
+    bool accepts_subtree(uint32_t tree_node, std::size_t max_length) const {
+        return subtree_in_class[tree_node] && subtree_max_run[tree_node] != SATURATED && subtree_max_run[tree_node] <= max_run &&
+               subtree_depth[tree_node] != SATURATED && subtree_depth[tree_node] <= max_length;
+    }
+
+private:
+    static const uint16_t SATURATED = UINT16_MAX;
+
+    bool class_characters[256];
+    std::size_t max_run;
+    // Indexed by tree node, over the paths below it
+    std::vector<bool> subtree_in_class;
+    std::vector<uint16_t> subtree_max_run;
+    std::vector<uint16_t> subtree_depth;
+    // tokens_up_to_length[length] holds every class token with at most length characters
+    std::vector<TokenBitmask> tokens_up_to_length;
+    // Indexed by tree node
+    std::vector<bool> nodes_leading_outside_class;
 };
 
+// The arrays either belong to the tree (when built from the regular tokens) or point into a tokenizer file
+// (see TokenEnforcerTokenizerData::initialize_from_file()), which the tree then keeps open.
 class TokenizerPrefixTree {
 public:
-    TokenizerPrefixTreeNode* root;
-    std::unordered_set<int> new_word_tokens;
-    std::unordered_map<int, std::string> tokens_to_strs;
+    static const uint32_t ROOT = 0;
+    static const uint32_t NO_NODE = UINT32_MAX;
+
+    ConstArrayView<TokenizerPrefixTreeNode> nodes;
+    // The character on the edge into each node (unused for the root)
+    ConstArrayView<char> node_characters;
+    ConstArrayView<int> token_pool;
+    // Indexed by token id, up to the largest regular token. Other ids have no flags.
+    ConstArrayView<TokenInfo> token_infos;
+    ConstArrayView<char> token_string_blob;
+
+    TokenizerPrefixTree(const std::vector<std::tuple<int, std::string, bool>>& regular_tokens);
+    TokenizerPrefixTree(ConstArrayView<TokenizerPrefixTreeNode> nodes,
+                        ConstArrayView<char> node_characters,
+                        ConstArrayView<int> token_pool,
+                        ConstArrayView<TokenInfo> token_infos,
+                        ConstArrayView<char> token_string_blob,
+                        std::shared_ptr<const MappedFile> storage);
+
+    bool has_token_flags(int token_id, uint8_t flags) const {
+        return token_id >= 0 && static_cast<std::size_t>(token_id) < token_infos.size() && (token_infos[token_id].flags & flags) == flags;
+    }
+
+    bool is_regular_token(int token_id) const { return has_token_flags(token_id, TokenInfo::REGULAR); }
+    bool is_new_word_token(int token_id) const { return has_token_flags(token_id, TokenInfo::NEW_WORD); }
+
+    // token_infos[token_id].string_length characters, for a regular token
+    const char* get_token_characters(int token_id) const {
+        return token_string_blob.data() + token_infos[token_id].string_offset;
+    }
+
+    // Throws std::out_of_range for ids that are not regular tokens
+    std::string get_token_string(int token_id) const {
+        if (!is_regular_token(token_id)) {
+            throw std::out_of_range("Not a regular token: " + std::to_string(token_id));
+        }
+        return std::string(get_token_characters(token_id), token_infos[token_id].string_length);
+    }
+
+    // NO_NODE if the node has no child for the character
+    uint32_t find_child(uint32_t tree_node, char character) const {
+        const TokenizerPrefixTreeNode& node = nodes[tree_node];
+        const char* first = node_characters.data() + node.first_child;
+        const char* last = first + node.num_children;
+        const char* found = std::lower_bound(first, last, character, [](char a, char b) {
+            return static_cast<unsigned char>(a) < static_cast<unsigned char>(b);
+        });
+        return found != last && *found == character ? static_cast<uint32_t>(found - node_characters.data()) : NO_NODE;
+    }
+
+    // Sets the tokens that end at the node (not those below it)
+    void add_node_tokens(uint32_t tree_node, TokenBitmask& allowed_tokens) const {
+        const TokenizerPrefixTreeNode& node = nodes[tree_node];
+        for (uint32_t token_idx = node.first_token; token_idx < node.first_token + node.num_tokens; ++token_idx) {
+            allowed_tokens.set(token_pool[token_idx]);
+        }
+    }
+
+    // Tree walks collect tokens by their position in token_pool ("tree order", token_pool.size() bits), where a node's
+    // tokens and a whole subtree are each a range, and translate the result to token ids once with map_tree_tokens().
+    void add_node_tree_tokens(uint32_t tree_node, TokenBitmask& allowed_tree_tokens) const {
+        allowed_tree_tokens.set_range(nodes[tree_node].first_token, nodes[tree_node].first_token + nodes[tree_node].num_tokens);
+    }
 
-    TokenizerPrefixTree(std::vector<std::tuple<int, std::string, bool>> regular_tokens);
+    void add_subtree_tree_tokens(uint32_t tree_node, TokenBitmask& allowed_tree_tokens) const {
+        allowed_tree_tokens.set_range(nodes[tree_node].first_token, nodes[tree_node].first_token + nodes[tree_node].subtree_size);
+    }
+
+    // ORs the token ids of the tree order bits into allowed_tokens
+    void map_tree_tokens(const TokenBitmask& allowed_tree_tokens, TokenBitmask& allowed_tokens) const {
+        const TokenBitmask::Word* words = allowed_tree_tokens.data();
+        for (std::size_t word_idx = 0; word_idx < allowed_tree_tokens.word_count(); ++word_idx) {
+            for (TokenBitmask::Word word = words[word_idx]; word; word &= word - 1) {
+                allowed_tokens.set(token_pool[word_idx * TokenBitmask::BITS_PER_WORD + TokenBitmask::count_trailing_zeros(word)]);
+            }
+        }
+    }
+
+    // Bytes held by the tree and token arrays
+    std::size_t memory_size() const {
+        return nodes.size() * (sizeof(TokenizerPrefixTreeNode) + sizeof(char)) + token_pool.size() * sizeof(int) +
+               token_infos.size() * sizeof(TokenInfo) + token_string_blob.size();
+    }
+
+    // Built on first use for each class, thread safe
+    const CharacterClassTokenIndex& get_character_class_index(const std::string& class_characters,
+                                                              const std::string& run_limited_characters = "",
+                                                              std::size_t max_run = 0);
 
 private:
-    void _add_token_to_tree(const std::string& token_str, int token_idx, TokenizerPrefixTreeNode* node);
+    static TokenInfo _make_token_info(const std::string& token_str, bool is_new_word, uint32_t string_offset);
+
+    std::vector<TokenizerPrefixTreeNode> owned_nodes;
+    std::vector<char> owned_node_characters;
+    std::vector<int> owned_token_pool;
+    std::vector<TokenInfo> owned_token_infos;
+    std::vector<char> owned_token_string_blob;
+    std::shared_ptr<const MappedFile> storage;
+
+    std::mutex character_class_indices_mutex;
+    std::map<std::tuple<std::string, std::string, std::size_t>, std::unique_ptr<CharacterClassTokenIndex>> character_class_indices;
+};
+
+// How TokenEnforcer finds the characters that a generated token appends to the output
+enum class IncrementalDecoding {
+    // The token's string from the tokenizer tree, without calling decode(). Exact when the strings of get_regular_tokens()
+    // are what each token appends in the middle of a word, and new word tokens include their leading space
+    // (true of tokenizers that decode byte fallback tokens to their raw bytes, like llama.cpp).
+    // Tokens without a string (EOS, control tokens) are decoded on their own.
+    TABLE,
+    // decode() of the current word with and without the token, for tokenizers whose tokens merge when decoded together.
+    // Costs two decode() calls per continuation token, growing with the word length.
+    DECODE,
+    // TABLE, cross-checked against DECODE on every token. Throws LMFormatEnforcerException on the first mismatch,
+    // meant for validating a new tokenizer adapter.
+    VERIFY
 };
 
 class TokenEnforcerTokenizerData
@@ -31,11 +245,26 @@ class TokenEnforcerTokenizerData
 public:
     void initialize();
 
+    // Writes the tokenizer tree, token strings, new word flags and EOS id to a versioned binary file,
+    // tagged with get_vocabulary_checksum(). Throws LMFormatEnforcerException if the file cannot be written.
+    void save_to_file(const std::string& path);
+    // Alternative to initialize() that maps a file written by save_to_file() instead of decoding the vocabulary,
+    // so startup costs little more than paging the file in. regular_tokens is left empty, and a tree from an earlier
+    // initialize() is replaced. Must not be called while TokenEnforcers are using this tokenizer data.
+    // Returns false and initializes nothing if the file is missing, damaged, from another format version
+    // or from another vocabulary.
+    bool initialize_from_file(const std::string& path);
+
     std::vector<std::tuple<int, std::string, bool>> regular_tokens;
-    TokenizerPrefixTree* tokenizer_tree;
+    TokenizerPrefixTree* tokenizer_tree = nullptr;
     std::function<std::string(const std::vector<int>&)> decoder;
     int eos_token_id;
+    // One past the largest token id (regular or EOS), i.e. the number of bits in a token bitmask
+    int vocab_size;
     std::string tokenizer_alphabet;
+    IncrementalDecoding incremental_decoding = IncrementalDecoding::TABLE;
+    // Shared by every TokenEnforcer that uses this tokenizer
+    AllowedTokenCache allowed_token_cache;
 
     // Methods that children have to implement
     virtual std::string decode(const std::vector<int>& tokens) const = 0;
@@ -43,6 +272,13 @@ public:
 protected:
     virtual std::vector<std::tuple<int, std::string, bool>> get_regular_tokens() const = 0;
     virtual int get_eos_token_id() const = 0;
+    // Identifies the vocabulary that a tokenizer file must come from. The default hashes get_regular_tokens() and the EOS id,
+    // which costs as much as initialize(), so adapters should override it with something cheaper, such as a hash of the
+    // tokenizer's raw vocabulary.
+    virtual uint64_t get_vocabulary_checksum() const;
 
     ~TokenEnforcerTokenizerData();
+
+private:
+    void _initialize_alphabet();
 };
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "./tokenbitmask.hpp"
+
+// The allowed tokens of a parser state, stored in whichever form is smallest:
+// - ALLOW_LIST: the sorted ids of the allowed tokens (e.g. ':' after a key)
+// - DENY_LIST: the sorted ids of the disallowed tokens (e.g. free text inside a string)
+// - BITMASK: a dense TokenBitmask, when neither list is shorter than vocab_size / 32 words
+// Callers can look at get_kind() to apply the mask in the cheapest way, or use the conversion helpers.
+class TokenMask {
+public:
+    enum class Kind {
+        ALLOW_LIST,
+        DENY_LIST,
+        BITMASK
+    };
+
+    TokenMask() : kind(Kind::ALLOW_LIST), vocab_size(0), num_allowed(0) {}
+
+    // Picks the smallest representation of the given bitmask
+    static TokenMask from_bitmask(TokenBitmask&& bitmask) {
+        TokenMask mask;
+        mask.vocab_size = bitmask.size();
+        mask.num_allowed = bitmask.count();
+        std::size_t num_denied = mask.vocab_size - mask.num_allowed;
+        std::size_t bitmask_words = bitmask.word_count();
+        if (mask.num_allowed <= num_denied && mask.num_allowed < bitmask_words) {
+            mask.kind = Kind::ALLOW_LIST;
+            mask.token_ids = bitmask.to_token_list();
+        } else if (num_denied < bitmask_words) {
+            mask.kind = Kind::DENY_LIST;
+            mask.token_ids.reserve(num_denied);
+            for (std::size_t word_idx = 0; word_idx < bitmask_words; ++word_idx) {
+                TokenBitmask::Word denied = ~bitmask.data()[word_idx];
+                while (denied) {
+                    std::size_t token_id = word_idx * TokenBitmask::BITS_PER_WORD + TokenBitmask::count_trailing_zeros(denied);
+                    if (token_id >= mask.vocab_size) {
+                        break;
+                    }
+                    mask.token_ids.push_back(static_cast<int>(token_id));
+                    denied &= denied - 1;
+                }
+            }
+        } else {
+            mask.kind = Kind::BITMASK;
+            mask.dense = std::move(bitmask);
+        }
+        return mask;
+    }
+
+    Kind get_kind() const { return kind; }
+    std::size_t size() const { return vocab_size; }
+    std::size_t count() const { return num_allowed; }
+
+    // ALLOW_LIST: the allowed ids, DENY_LIST: the disallowed ids, sorted. Empty for BITMASK.
+    const std::vector<int>& get_token_ids() const { return token_ids; }
+    // Only populated for BITMASK
+    const TokenBitmask& get_bitmask() const { return dense; }
+
+    bool test(int token_id) const {
+        switch (kind) {
+            case Kind::ALLOW_LIST:
+                return std::binary_search(token_ids.begin(), token_ids.end(), token_id);
+            case Kind::DENY_LIST:
+                return token_id >= 0 && static_cast<std::size_t>(token_id) < vocab_size &&
+                       !std::binary_search(token_ids.begin(), token_ids.end(), token_id);
+            default:
+                return dense.test(token_id);
+        }
+    }
+
+    // Writes TokenBitmask::num_words(size()) words to destination
+    void write_bitmask(TokenBitmask::Word* destination) const {
+        const std::size_t num_words = TokenBitmask::num_words(vocab_size);
+        switch (kind) {
+            case Kind::ALLOW_LIST:
+                std::fill(destination, destination + num_words, 0);
+                for (int token_id : token_ids) {
+                    destination[token_id / TokenBitmask::BITS_PER_WORD] |= TokenBitmask::Word(1) << (token_id % TokenBitmask::BITS_PER_WORD);
+                }
+                break;
+            case Kind::DENY_LIST:
+                std::fill(destination, destination + num_words, ~TokenBitmask::Word(0));
+                if (vocab_size % TokenBitmask::BITS_PER_WORD) {
+                    destination[num_words - 1] = (TokenBitmask::Word(1) << (vocab_size % TokenBitmask::BITS_PER_WORD)) - 1;
+                }
+                for (int token_id : token_ids) {
+                    destination[token_id / TokenBitmask::BITS_PER_WORD] &= ~(TokenBitmask::Word(1) << (token_id % TokenBitmask::BITS_PER_WORD));
+                }
+                break;
+            default:
+                dense.copy_to(destination);
+                break;
+        }
+    }
+
+    TokenBitmask to_bitmask() const {
+        TokenBitmask bitmask(vocab_size);
+        write_bitmask(bitmask.data());
+        return bitmask;
+    }
+
+    std::vector<int> to_token_list() const {
+        if (kind == Kind::ALLOW_LIST) {
+            return token_ids;
+        }
+        return to_bitmask().to_token_list();
+    }
+
+    // Bytes held by the chosen representation
+    std::size_t memory_size() const {
+        return token_ids.size() * sizeof(int) + dense.word_count() * sizeof(TokenBitmask::Word);
+    }
+
+private:
+    Kind kind;
+    std::size_t vocab_size;
+    std::size_t num_allowed;
+    std::vector<int> token_ids;
+    TokenBitmask dense;
+};
+
+typedef std::shared_ptr<const TokenMask> TokenMaskPtr;
@@ -0,0 +1,116 @@
+#include "lmfe/executor.hpp"
+
+#include <algorithm>
+
+ThreadPoolExecutor::ThreadPoolExecutor(std::size_t num_threads) : stopping(false) {
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (std::size_t i = 1; i < num_threads; ++i) {
+        workers.emplace_back(&ThreadPoolExecutor::worker_loop, this);
+    }
+}
+
+ThreadPoolExecutor::~ThreadPoolExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPoolExecutor::run_available_tasks(Batch& batch) {
+    while (true) {
+        std::size_t task_idx = batch.next_task.fetch_add(1);
+        if (task_idx >= batch.num_tasks) {
+            return;
+        }
+        try {
+            (*batch.tasks)[task_idx]();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            if (!batch.error) {
+                batch.error = std::current_exception();
+            }
+        }
+        if (batch.remaining_tasks.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(batch.mutex);
+            batch.finished.notify_all();
+        }
+    }
+}
+
+void ThreadPoolExecutor::worker_loop() {
+    while (true) {
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            work_available.wait(lock, [this]() { return stopping || !pending_batches.empty(); });
+            if (stopping) {
+                return;
+            }
+            batch = pending_batches.front();
+            if (batch->next_task.load() >= batch->num_tasks) {
+                // Every task of this batch was already claimed, stop offering it
+                pending_batches.pop_front();
+                continue;
+            }
+        }
+        run_available_tasks(*batch);
+    }
+}
+
+void ThreadPoolExecutor::run_all(const std::vector<std::function<void()>>& tasks) {
+    if (tasks.empty()) {
+        return;
+    }
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    batch->tasks = &tasks;
+    batch->num_tasks = tasks.size();
+    batch->next_task = 0;
+    batch->remaining_tasks = tasks.size();
+    if (!workers.empty() && tasks.size() > 1) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending_batches.push_back(batch);
+        }
+        work_available.notify_all();
+    }
+
+    run_available_tasks(*batch);
+    {
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&batch]() { return batch->remaining_tasks.load() == 0; });
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = std::find(pending_batches.begin(), pending_batches.end(), batch);
+        if (it != pending_batches.end()) {
+            pending_batches.erase(it);
+        }
+    }
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+}
+
+void ThreadPoolExecutor::submit(std::function<void()> task) {
+    if (workers.empty()) {
+        task();
+        return;
+    }
+    std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+    batch->submitted_tasks.push_back(std::move(task));
+    batch->tasks = &batch->submitted_tasks;
+    batch->num_tasks = 1;
+    batch->next_task = 0;
+    batch->remaining_tasks = 1;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending_batches.push_back(batch);
+    }
+    work_available.notify_one();
+}
@@ -1,4 +1,6 @@
 #include "lmfe/jsonschemaparser.hpp"
+#include <map>
+#include <unordered_map>
 
 using namespace valijson::constraints;
 using namespace valijson;
@@ -8,7 +10,16 @@ typedef const Subschema* JsonSchemaPtr;
 JsonSchemaPtr get_any_json_object_schema();
 const std::string WHITESPACE_CHARACTERS = " \t\n\r\f\v";
 const std::string COMPLETE_ALPHABET = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ!@#$%^&*()_+-=[]{};:,./<>? `'\"";
+const std::string DIGIT_CHARACTERS = "0123456789";
 const int MAX_CONSECUTIVE_WHITESPACES = 12;
+const CharacterSet WHITESPACE_CHARACTER_SET(WHITESPACE_CHARACTERS);
+const CharacterSet DIGIT_CHARACTER_SET(DIGIT_CHARACTERS);
+const CharacterSet FREE_TEXT_CHARACTER_SET = CharacterSet(COMPLETE_ALPHABET + WHITESPACE_CHARACTERS).add('\\');
+
+// The JsonSchemaParser whose add_character() / get_allowed_characters() is running on this thread.
+// Parsing states push nested value parsers onto its object_stack. It is kept per thread (and not in the
+// shared _Context) so that parsers derived from the same schema can be advanced from several threads at once.
+static thread_local JsonSchemaParser* active_parser = nullptr;
 
 std::string _ANY_JSON_SCHEMA_STRING = R"(
     {"anyOf": [{"type": "integer"}, {"type": "number"}, {"type": "string"}, {"type": "boolean"}, {"type": "object"}, {"type": "null"}, {"type": "array"}]}
@@ -25,6 +36,8 @@ const T *findConstraint(JsonSchemaPtr schema)
     return nullptr;
 }
 
+// Parsing states leave root out of their cache keys. It is only read for the alphabet and for fields that every root
+// leaves untouched, so states created by different parsers (or schemas) with the same fields behave identically.
 class BaseParsingState : public CharacterLevelParser
 {
 public:
@@ -57,18 +70,48 @@ public:
         return CharacterLevelParserPtr(new_state);
     }
 
+    // The contents run is taken with a single new state
+    CharacterLevelParserPtr add_string(std::string_view characters) override {
+        std::size_t run_length = get_contents_run_length(characters);
+        if (run_length == 0) {
+            return CharacterLevelParser::add_string(characters);
+        }
+        PrimitiveParsingState* new_state = clone();
+        new_state->append_contents(characters.substr(0, run_length));
+        CharacterLevelParserPtr parser(new_state);
+        return run_length == characters.size() ? parser : parser->add_string(characters.substr(run_length));
+    }
+
+    // How many of the leading characters this state allows and only adds to its contents, without any other change.
+    // Those never end the value or open a nested one, so JsonSchemaParser::add_string() can hand them over in one call.
+    virtual std::size_t get_contents_run_length(std::string_view) const {
+        return 0;
+    }
+
     bool can_end() const override {
         return true;
     }
 
 public:
     std::string parsed_string;
+
+protected:
+    virtual void append_contents(std::string_view contents) {
+        parsed_string.append(contents.data(), contents.size());
+    }
 };
 
 
+// A JSON string (or, without quotes, one of a fixed set of values such as true / false).
+// With allowed_strings, the value is one of them and trie_node is the node of parsed_string in their trie.
+// Without it, the value is free text.
 class StringParsingState : public PrimitiveParsingState {
 private:
-    std::vector<std::string> allowed_strings;
+    StringTriePtr allowed_strings;
+    uint32_t trie_node;
+    // The key text picks the value's schema and which required keys are present, so unlike a free text value,
+    // a key state is only cache equal to a state with the same parsed_string
+    bool is_object_key;
     bool seen_closing_quote;
     bool seen_opening_quote;
     size_t min_length;
@@ -79,13 +122,16 @@ private:
 public:
     StringParsingState(
         JsonSchemaParser* root,
-        std::vector<std::string> allowed_strings,
+        StringTriePtr allowed_strings,
         bool require_opening_quote,
         bool require_closing_quote = true,
         size_t min_length = -1,
-        size_t max_length = -1
+        size_t max_length = -1,
+        bool is_object_key = false
     ) : PrimitiveParsingState(root),
         allowed_strings(allowed_strings),
+        trie_node(StringTrie::ROOT),
+        is_object_key(is_object_key),
         seen_closing_quote(false),
         seen_opening_quote(!require_opening_quote),
         require_closing_quote(require_closing_quote),
@@ -100,9 +146,11 @@ public:
             require_opening_quote,
             require_closing_quote,
             min_length,
-            max_length
+            max_length,
+            is_object_key
         );
         clone->parsed_string = parsed_string;
+        clone->trie_node = trie_node;
         clone->seen_closing_quote = seen_closing_quote;
         clone->seen_opening_quote = seen_opening_quote;
         return clone;
@@ -123,6 +171,8 @@ public:
                 newStringState->seen_closing_quote = true;
                 newStringState->parsed_string = newStringState->parsed_string.substr(0, newStringState->parsed_string.size() - 1);
             }
+        } else if (allowed_strings) {
+            newStringState->trie_node = allowed_strings->find_child(trie_node, new_character);
         }
         if (new_character == '\\') {
             // Handle escaping characters
@@ -138,45 +188,74 @@ public:
         return newState;
     }
 
-    std::string get_allowed_characters() const {
-        if (!seen_opening_quote) {
-            return "\"" + WHITESPACE_CHARACTERS;
+    // Free text up to the closing quote or the length limit, or a path down the trie of allowed strings
+    std::size_t get_contents_run_length(std::string_view characters) const override {
+        if (allowed_strings) {
+            return get_trie_run_length(characters);
         }
-        if (seen_closing_quote) {
-            return WHITESPACE_CHARACTERS;
+        if (!seen_opening_quote || seen_closing_quote || !require_closing_quote) {
+            return 0;
         }
-        if (!allowed_strings.empty()) {
-            std::vector<std::string> allowed_continuations;
-            for (const std::string& s : allowed_strings) {
-                if (s.find(parsed_string) == 0) {
-                    allowed_continuations.push_back(s.substr(parsed_string.size()));
-                }
+        std::size_t length = parsed_string.size();
+        std::size_t run_length = 0;
+        for (; run_length < characters.size(); ++run_length) {
+            char character = characters[run_length];
+            bool is_below_min_length = min_length != static_cast<size_t>(-1) && length < min_length;
+            bool is_full = max_length != static_cast<size_t>(-1) && length >= max_length;
+            if (!root->context->string_characters.contains(character) || (is_full && !is_below_min_length)) {
+                break;
             }
-            std::vector<char> allowed_next_characters;
-            for (const std::string& continuation : allowed_continuations) {
-                if (!continuation.empty()) {
-                    allowed_next_characters.push_back(continuation[0]);
-                }
+            if (length != 0 || !WHITESPACE_CHARACTER_SET.contains(character)) {
+                length++;
             }
-            std::sort(allowed_next_characters.begin(), allowed_next_characters.end());
-            allowed_next_characters.erase(std::unique(allowed_next_characters.begin(), allowed_next_characters.end()), allowed_next_characters.end());
-            if (std::find(allowed_strings.begin(), allowed_strings.end(), parsed_string) != allowed_strings.end() && require_closing_quote) {
-                allowed_next_characters.push_back('"');
+        }
+        return run_length;
+    }
+
+    ShortcutKey shortcut_key() const override {
+        ShortcutKey key;
+        if (allowed_strings || !seen_opening_quote || seen_closing_quote || !require_closing_quote) {
+            return key;
+        }
+        if (max_length != static_cast<size_t>(-1) && (parsed_string.empty() || parsed_string.size() >= max_length)) {
+            // Leading whitespace is not counted in the length, and a full string only accepts the closing quote
+            return key;
+        }
+        key.kind = ShortcutKey::Kind::CHARACTER_CLASS;
+        key.character_class = root->context->alphabet_without_quotes + "\\";
+        key.run_limited_characters = WHITESPACE_CHARACTERS;
+        key.max_run = MAX_CONSECUTIVE_WHITESPACES;
+        key.cur_length = parsed_string.size();
+        key.min_length = min_length;
+        key.max_length = max_length;
+        return key;
+    }
+
+    CharacterSet get_allowed_character_set() const override {
+        if (!seen_opening_quote) {
+            return CharacterSet(WHITESPACE_CHARACTER_SET).add('"');
+        }
+        if (seen_closing_quote) {
+            return WHITESPACE_CHARACTER_SET;
+        }
+        if (allowed_strings) {
+            CharacterSet allowed_next_characters = allowed_strings->get_next_characters(trie_node);
+            if (allowed_strings->is_string_end(trie_node) && require_closing_quote) {
+                allowed_next_characters.add('"');
             }
             if (parsed_string.empty() && (!seen_opening_quote || !require_opening_quote)) {
-                allowed_next_characters.insert(allowed_next_characters.end(), WHITESPACE_CHARACTERS.begin(), WHITESPACE_CHARACTERS.end());
+                allowed_next_characters |= WHITESPACE_CHARACTER_SET;
             }
-            std::string allowed_characters(allowed_next_characters.begin(), allowed_next_characters.end());
-            return allowed_characters;
+            return allowed_next_characters;
         } else {
             if (min_length != -1 && parsed_string.size() < min_length) {
-                return root->context->alphabet_without_quotes + "\\";
+                return root->context->string_characters;
             }
             if (max_length != -1 && parsed_string.size() >= max_length) {
-                return "\"";
+                return CharacterSet("\"");
             }
             //return root->config.alphabet + "\\";
-            return COMPLETE_ALPHABET + WHITESPACE_CHARACTERS + "\\";
+            return FREE_TEXT_CHARACTER_SET;
         }
     }
 
@@ -184,13 +263,109 @@ public:
         if (require_closing_quote) {
             return seen_closing_quote;
         } else {
-            if (!allowed_strings.empty()) {
-                return std::find(allowed_strings.begin(), allowed_strings.end(), parsed_string) != allowed_strings.end();
+            if (allowed_strings) {
+                return allowed_strings->is_string_end(trie_node);
             } else {
                 return !parsed_string.empty();
             }
         }
     }
+
+    std::size_t cache_key() const override {
+        std::size_t key = type_cache_key();
+        if (allowed_strings) {
+            hash_combine(key, allowed_strings->get_hash());
+        }
+        hash_combine(key, seen_closing_quote);
+        hash_combine(key, seen_opening_quote);
+        hash_combine(key, require_closing_quote);
+        hash_combine(key, require_opening_quote);
+        hash_combine(key, min_length);
+        hash_combine(key, max_length);
+        hash_combine(key, is_object_key);
+        if (is_object_key) {
+            hash_combine(key, std::hash<std::string>()(parsed_string));
+        } else if (!allowed_strings) {
+            hash_combine(key, get_effective_length());
+        } else {
+            hash_combine(key, trie_node);
+        }
+        return nonzero_cache_key(key);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        if (typeid(other) != typeid(*this)) {
+            return false;
+        }
+        const StringParsingState& other_state = static_cast<const StringParsingState&>(other);
+        if (!allowed_strings != !other_state.allowed_strings ||
+            (allowed_strings && !(*allowed_strings == *other_state.allowed_strings)) ||
+            seen_closing_quote != other_state.seen_closing_quote ||
+            seen_opening_quote != other_state.seen_opening_quote ||
+            require_closing_quote != other_state.require_closing_quote ||
+            require_opening_quote != other_state.require_opening_quote ||
+            min_length != other_state.min_length ||
+            max_length != other_state.max_length ||
+            is_object_key != other_state.is_object_key) {
+            return false;
+        }
+        if (is_object_key) {
+            return parsed_string == other_state.parsed_string;
+        }
+        if (!allowed_strings) {
+            return get_effective_length() == other_state.get_effective_length();
+        }
+        return trie_node == other_state.trie_node;
+    }
+
+protected:
+    // Leading whitespace is not part of the string, see add_character()
+    void append_contents(std::string_view contents) override {
+        std::size_t start = 0;
+        while (parsed_string.empty() && start < contents.size() && WHITESPACE_CHARACTER_SET.contains(contents[start])) {
+            start++;
+        }
+        parsed_string.append(contents.data() + start, contents.size() - start);
+        if (allowed_strings) {
+            for (std::size_t char_idx = start; char_idx < contents.size(); ++char_idx) {
+                trie_node = allowed_strings->find_child(trie_node, contents[char_idx]);
+            }
+        }
+    }
+
+private:
+    // Leading whitespace and quotes are left to add_character()
+    std::size_t get_trie_run_length(std::string_view characters) const {
+        if (!seen_opening_quote || seen_closing_quote) {
+            return 0;
+        }
+        uint32_t node = trie_node;
+        std::size_t run_length = 0;
+        for (; run_length < characters.size(); ++run_length) {
+            char character = characters[run_length];
+            if (character == '"' || (node == StringTrie::ROOT && WHITESPACE_CHARACTER_SET.contains(character))) {
+                break;
+            }
+            node = allowed_strings->find_child(node, character);
+            if (node == StringTrie::NO_NODE) {
+                break;
+            }
+        }
+        return run_length;
+    }
+
+    // Free text only depends on how many characters were parsed, and only up to the largest length limit
+    // (or up to 1 without limits, since an empty string still accepts leading whitespace)
+    size_t get_effective_length() const {
+        size_t length_limit = 1;
+        if (min_length != static_cast<size_t>(-1)) {
+            length_limit = std::max(length_limit, min_length);
+        }
+        if (max_length != static_cast<size_t>(-1)) {
+            length_limit = std::max(length_limit, max_length);
+        }
+        return std::min(parsed_string.size(), length_limit);
+    }
 };
 
 class NumberParsingState : public PrimitiveParsingState {
@@ -232,19 +407,20 @@ public:
         return newState;
     }
 
-    std::string get_allowed_characters() const override {
+    CharacterSet get_allowed_character_set() const override {
         if (seen_whitespace_after_digits) {
-            return WHITESPACE_CHARACTERS;
+            return WHITESPACE_CHARACTER_SET;
         }
-        std::string allowed_characters = "0123456789";
+        CharacterSet allowed_characters = DIGIT_CHARACTER_SET;
         if (parsed_string.empty()) {
-            allowed_characters += "-" + WHITESPACE_CHARACTERS;
+            allowed_characters.add('-');
+            allowed_characters |= WHITESPACE_CHARACTER_SET;
         }
         if (allow_floating_point && !seen_decimal_point) {
-            allowed_characters += ".";
+            allowed_characters.add('.');
         }
         if (!parsed_string.empty() && isdigit(parsed_string.back())) {
-            allowed_characters += WHITESPACE_CHARACTERS;
+            allowed_characters |= WHITESPACE_CHARACTER_SET;
         }
         return allowed_characters;
     }
@@ -252,44 +428,88 @@ public:
     bool can_end() const override {
         return !parsed_string.empty() && (isdigit(parsed_string.back()) || seen_whitespace_after_digits);
     }
+
+    std::size_t get_contents_run_length(std::string_view characters) const override {
+        if (seen_whitespace_after_digits) {
+            return 0;
+        }
+        std::size_t run_length = 0;
+        while (run_length < characters.size() && DIGIT_CHARACTER_SET.contains(characters[run_length])) {
+            run_length++;
+        }
+        return run_length;
+    }
+
+    // Digits are allowed until the number is followed by whitespace, and keep being allowed after each other
+    ShortcutKey shortcut_key() const override {
+        ShortcutKey key;
+        if (!seen_whitespace_after_digits) {
+            key.kind = ShortcutKey::Kind::CHARACTER_CLASS;
+            key.character_class = DIGIT_CHARACTERS;
+        }
+        return key;
+    }
+
+    // The digits themselves do not matter, only whether there are any and whether the last character was one
+    std::size_t cache_key() const override {
+        std::size_t key = type_cache_key();
+        hash_combine(key, allow_floating_point);
+        hash_combine(key, seen_decimal_point);
+        hash_combine(key, seen_whitespace_after_digits);
+        hash_combine(key, parsed_string.empty());
+        hash_combine(key, ends_with_digit());
+        return nonzero_cache_key(key);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        if (typeid(other) != typeid(*this)) {
+            return false;
+        }
+        const NumberParsingState& other_state = static_cast<const NumberParsingState&>(other);
+        return allow_floating_point == other_state.allow_floating_point &&
+               seen_decimal_point == other_state.seen_decimal_point &&
+               seen_whitespace_after_digits == other_state.seen_whitespace_after_digits &&
+               parsed_string.empty() == other_state.parsed_string.empty() &&
+               ends_with_digit() == other_state.ends_with_digit();
+    }
+
+private:
+    bool ends_with_digit() const {
+        return !parsed_string.empty() && isdigit(parsed_string.back());
+    }
 };
 
 class ObjectParsingState : public BaseParsingState
 {
 public:
-    JsonSchemaPtr schema_object;
+    const CompiledSchema* schema_object;
     ObjectParsingStage current_stage;
-    std::vector<std::string> existing_keys;
+    // Bit i is set once schema_object->keys[i] was parsed. Other keys (of dictionaries) do not change what the object accepts.
+    std::vector<uint64_t> existing_keys;
     std::string current_key;
-    bool is_dictionary;
 
-    ObjectParsingState(JsonSchemaPtr schema_object, JsonSchemaParser* root) :
+    ObjectParsingState(const CompiledSchema* schema_object, JsonSchemaParser* root) :
         BaseParsingState(root),
         schema_object(schema_object),
-        current_stage(ObjectParsingStage::START_OBJECT) {
-        const PropertiesConstraint* propertiesConstraint = findConstraint<PropertiesConstraint>(schema_object);
-        is_dictionary = (propertiesConstraint == nullptr) 
-            || (propertiesConstraint->m_properties.size() + propertiesConstraint->m_patternProperties.size()) == 0;
-    }
+        current_stage(ObjectParsingStage::START_OBJECT),
+        existing_keys(schema_object->required_keys.size(), 0) {}
 
     ObjectParsingState* clone() {
         ObjectParsingState* newInstance = new ObjectParsingState(schema_object, root);
         newInstance->current_stage = current_stage;
         newInstance->existing_keys = existing_keys;
         newInstance->current_key = current_key;
-        newInstance->is_dictionary = is_dictionary;
         return newInstance;
     }
 
+    // The properties that were not parsed yet, empty for dictionaries (which take any key)
     std::vector<std::string> get_current_possible_keys() const {
         std::vector<std::string> possible_keys;
-        if (!is_dictionary) {
-            const PropertiesConstraint* propertiesConstraint = findConstraint<PropertiesConstraint>(schema_object);
-            for (const auto& key : propertiesConstraint->m_properties) {
-                possible_keys.push_back(std::string(key.first));
-            }
-            for (const auto& key : existing_keys) {
-                possible_keys.erase(std::remove(possible_keys.begin(), possible_keys.end(), key), possible_keys.end());
+        if (!schema_object->is_dictionary) {
+            for (std::size_t key_idx = 0; key_idx < schema_object->keys.size(); ++key_idx) {
+                if (test_key_bit(schema_object->property_keys, key_idx) && !test_key_bit(existing_keys, key_idx)) {
+                    possible_keys.push_back(schema_object->keys[key_idx]);
+                }
             }
         }
         return possible_keys;
@@ -309,36 +529,32 @@ public:
             }
             if (new_character == '"') {
                 std::vector<std::string> possible_keys = get_current_possible_keys();
+                StringTriePtr key_trie = possible_keys.empty() ? nullptr : std::make_shared<const StringTrie>(possible_keys);
                 // We send require_opening_quote=true and then add_character('"') instead of require_opening_quote=false
                 // Because there is a difference between "don't need a quote" and "received it before creating the parser"
-                CharacterLevelParserPtr key_parser = std::make_shared<StringParsingState>(root, possible_keys, true, true);
+                CharacterLevelParserPtr key_parser = std::make_shared<StringParsingState>(root, key_trie, true, true, -1, -1, true);
                 key_parser = key_parser->add_character('"');
-                root->context->active_parser->object_stack.push_back(key_parser);
+                active_parser->object_stack.push(key_parser);
                 newState->current_stage = ObjectParsingStage::PARSING_KEY_VALUE_SEPARATOR;
             }
         } else if (current_stage == ObjectParsingStage::PARSING_KEY_VALUE_SEPARATOR) {
             if (new_character == ':') {
-                const PropertiesConstraint* propertiesConstraint = findConstraint<PropertiesConstraint>(schema_object);
                 newState->current_stage = ObjectParsingStage::PARSING_VALUE;
-                newState->current_key = root->context->active_parser->last_parsed_string;
-                newState->existing_keys.push_back(newState->current_key);
-                std::sort(newState->existing_keys.begin(), newState->existing_keys.end()); // Sorted for std::includes
-                if (is_dictionary) {
-                    JsonSchemaPtr value_schema;
-                    
-                    if (propertiesConstraint && propertiesConstraint->m_additionalProperties) {
-                        value_schema = propertiesConstraint->m_additionalProperties;
-                    } else {
-                        value_schema = get_any_json_object_schema();
-                    }
-                    CharacterLevelParserPtr current_key_parser = get_parser(root, value_schema);
-                    root->context->active_parser->object_stack.push_back(current_key_parser);
+                newState->current_key = active_parser->last_parsed_string;
+                int key_idx = schema_object->find_key(newState->current_key);
+                if (key_idx != -1) {
+                    newState->existing_keys[key_idx / 64] |= uint64_t(1) << (key_idx % 64);
+                }
+                const CompiledSchema* value_schema;
+                if (schema_object->is_dictionary) {
+                    value_schema = schema_object->additional_properties;
                 } else {
-                    PropertiesConstraint::String key = PropertiesConstraint::String(newState->current_key);
-                    JsonSchemaPtr value_schema = propertiesConstraint->m_properties.at(key);
-                    CharacterLevelParserPtr current_key_parser = get_parser(root, value_schema);
-                    root->context->active_parser->object_stack.push_back(current_key_parser);
+                    if (key_idx == -1 || schema_object->key_schemas[key_idx] == nullptr) {
+                        throw std::out_of_range("JsonSchemaParser: Unknown property " + newState->current_key);
+                    }
+                    value_schema = schema_object->key_schemas[key_idx];
                 }
+                active_parser->object_stack.push(get_parser(root, value_schema));
             }
         } else if (current_stage == ObjectParsingStage::PARSING_VALUE) {
             // If we receive a character during parsing value, it means that it's the finishing character
@@ -361,64 +577,82 @@ public:
         return CharacterLevelParserPtr(newState);
     }
 
-    std::string get_allowed_characters() const override { 
-        std::vector<char> possible_characters;
+    CharacterSet get_allowed_character_set() const override {
+        CharacterSet possible_characters = WHITESPACE_CHARACTER_SET;
 
-        std::vector<std::string> possible_keys = get_current_possible_keys();
-        
-
-        const RequiredConstraint* requiredConstraint = findConstraint<RequiredConstraint>(schema_object);
-        RequiredConstraint::RequiredProperties required_keys = (requiredConstraint != nullptr) ? requiredConstraint->m_requiredProperties : RequiredConstraint::RequiredProperties();
-        std::vector<std::string> required_keys_vector(required_keys.begin(), required_keys.end());
-        std::sort(required_keys_vector.begin(), required_keys_vector.end());
-
-        bool can_end = std::includes(existing_keys.begin(), existing_keys.end(), required_keys_vector.begin(), required_keys_vector.end());
-        bool can_parse_key = is_dictionary || std::any_of(possible_keys.begin(), possible_keys.end(), [&](const std::string& key) {
-            return std::find(existing_keys.begin(), existing_keys.end(), key) == existing_keys.end();
-        });
-
-        possible_characters.insert(possible_characters.end(), WHITESPACE_CHARACTERS.begin(), WHITESPACE_CHARACTERS.end());
+        bool can_end = true;
+        bool can_parse_key = schema_object->is_dictionary;
+        for (std::size_t word_idx = 0; word_idx < existing_keys.size(); ++word_idx) {
+            can_end = can_end && (schema_object->required_keys[word_idx] & ~existing_keys[word_idx]) == 0;
+            can_parse_key = can_parse_key || (schema_object->property_keys[word_idx] & ~existing_keys[word_idx]) != 0;
+        }
 
         if (current_stage == ObjectParsingStage::START_OBJECT) {
-            possible_characters.push_back('{');
+            possible_characters.add('{');
         }
         else if (current_stage == ObjectParsingStage::PARSING_KEY_OR_END) {
             if (can_end) {
-                possible_characters.push_back('}');
+                possible_characters.add('}');
             }
             if (can_parse_key) {
-                possible_characters.push_back('"');
+                possible_characters.add('"');
             }
         }
         else if (current_stage == ObjectParsingStage::PARSING_KEY_VALUE_SEPARATOR) {
-            possible_characters.push_back(':');
+            possible_characters.add(':');
         }
         else if (current_stage == ObjectParsingStage::PARSING_VALUE) {
             if (can_end) {
-                possible_characters.push_back('}');
+                possible_characters.add('}');
             }
             if (can_parse_key) {
-                possible_characters.push_back(',');
+                possible_characters.add(',');
             }
         }
         else if (current_stage == ObjectParsingStage::PARSING_SEPARATOR_OR_END) {
             if (can_end) {
-                possible_characters.push_back('}');
+                possible_characters.add('}');
             }
             if (can_parse_key) {
-                possible_characters.push_back(',');
+                possible_characters.add(',');
             }
         }
 
-        return std::string(possible_characters.begin(), possible_characters.end());
+        return possible_characters;
     }
 
     bool can_end() const override { return current_stage == ObjectParsingStage::END_OBJECT; }
+
+    // current_key is only recorded, never read back, so it is not part of the key
+    std::size_t cache_key() const override {
+        std::size_t key = type_cache_key();
+        hash_combine(key, std::hash<const CompiledSchema*>()(schema_object));
+        hash_combine(key, static_cast<std::size_t>(current_stage));
+        for (uint64_t existing_keys_word : existing_keys) {
+            hash_combine(key, std::hash<uint64_t>()(existing_keys_word));
+        }
+        return nonzero_cache_key(key);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        if (typeid(other) != typeid(*this)) {
+            return false;
+        }
+        const ObjectParsingState& other_state = static_cast<const ObjectParsingState&>(other);
+        return schema_object == other_state.schema_object &&
+               current_stage == other_state.current_stage &&
+               existing_keys == other_state.existing_keys;
+    }
+
+private:
+    static bool test_key_bit(const std::vector<uint64_t>& key_bits, std::size_t key_idx) {
+        return (key_bits[key_idx / 64] >> (key_idx % 64)) & 1;
+    }
 };
 
 class ListParsingState : public PrimitiveParsingState {
 private:
-    JsonSchemaPtr list_member_type;
+    const CompiledSchema* list_member_type;
     bool seen_list_opener;
     bool seen_list_closer;
     size_t num_items_seen;
@@ -428,7 +662,7 @@ private:
 public:
     ListParsingState(
         JsonSchemaParser* root,
-        JsonSchemaPtr list_member_type,
+        const CompiledSchema* list_member_type,
         size_t min_items = -1,
         size_t max_items = -1
     ) : 
@@ -473,13 +707,13 @@ public:
                 parsers.push_back(CharacterLevelParserPtr(new ForceStopParser()));
                 parser_to_push = CharacterLevelParserPtr(new UnionParser(parsers));
             }
-            this->root->context->active_parser->object_stack.push_back(parser_to_push);
+            active_parser->object_stack.push(parser_to_push);
         } else if (new_character == ']') {
             self->seen_list_closer = true;
         } else if (new_character == ',') {
             if (!self->seen_list_closer) {
                 self->num_items_seen += 1;
-                this->root->context->active_parser->object_stack.push_back(
+                active_parser->object_stack.push(
                     get_parser(
                         this->root,
                         this->list_member_type
@@ -490,13 +724,13 @@ public:
         return base_state;
     }
 
-    std::string get_allowed_characters() const override {
+    CharacterSet get_allowed_character_set() const override {
         if (!this->seen_list_opener) {
-            return "[" + WHITESPACE_CHARACTERS;
+            return CharacterSet(WHITESPACE_CHARACTER_SET).add('[');
         } else if (!this->seen_list_closer) {
-            return this->get_allowed_control_characters() + WHITESPACE_CHARACTERS;
+            return this->get_allowed_control_characters() | WHITESPACE_CHARACTER_SET;
         } else {
-            return "";
+            return CharacterSet();
         }
     }
 
@@ -504,26 +738,64 @@ public:
         return this->seen_list_closer;
     }
 
-    std::string get_allowed_control_characters() const {
+    CharacterSet get_allowed_control_characters() const {
         int num_items = this->num_items_seen;
-        bool is_on_top = this->root->context->active_parser->object_stack.back().get() == this;
+        bool is_on_top = active_parser->object_stack.top().get() == this;
         if ((!is_on_top) && this->root->last_non_whitespace_character != "[") {
             // If there is an active parser above us, and the last character is not [, 
             // there is an active item parser on the stack that we did not count yet.
             num_items += 1;
         }
-        std::string control_characters = "";
+        CharacterSet control_characters;
         bool has_enough_items = this->min_items == -1 || num_items >= this->min_items;
         bool can_add_another_item = this->max_items == -1 || num_items < this->max_items;
 
         if (can_add_another_item) {
-            control_characters += ",";
+            control_characters.add(',');
         }
         if (has_enough_items) {
-            control_characters += "]";
+            control_characters.add(']');
         }
         return control_characters;
     }
+
+    // parsed_string is not read by lists. Whether the list is on top of the stack is covered by the JsonSchemaParser's key.
+    std::size_t cache_key() const override {
+        std::size_t key = type_cache_key();
+        hash_combine(key, std::hash<const CompiledSchema*>()(list_member_type));
+        hash_combine(key, seen_list_opener);
+        hash_combine(key, seen_list_closer);
+        hash_combine(key, min_items);
+        hash_combine(key, max_items);
+        hash_combine(key, get_effective_num_items());
+        return nonzero_cache_key(key);
+    }
+
+    bool cache_equals(const CharacterLevelParser& other) const override {
+        if (typeid(other) != typeid(*this)) {
+            return false;
+        }
+        const ListParsingState& other_state = static_cast<const ListParsingState&>(other);
+        return list_member_type == other_state.list_member_type &&
+               seen_list_opener == other_state.seen_list_opener &&
+               seen_list_closer == other_state.seen_list_closer &&
+               min_items == other_state.min_items &&
+               max_items == other_state.max_items &&
+               get_effective_num_items() == other_state.get_effective_num_items();
+    }
+
+private:
+    // Once past every item limit, additional items no longer change what the list accepts
+    size_t get_effective_num_items() const {
+        size_t items_limit = 0;
+        if (min_items != static_cast<size_t>(-1)) {
+            items_limit = std::max(items_limit, min_items);
+        }
+        if (max_items != static_cast<size_t>(-1)) {
+            items_limit = std::max(items_limit, max_items);
+        }
+        return std::min(num_items_seen, items_limit);
+    }
 };
 
 std::vector<std::string> getEnumValues(const EnumConstraint* enumConstraint)
@@ -546,123 +818,371 @@ std::vector<std::string> getEnumValues(const EnumConstraint* enumConstraint)
     return enumValues;
 }
 
-CharacterLevelParserPtr get_parser(JsonSchemaParser *parser, const valijson::Subschema *schema)
-{
-    if (!schema)
-    {
-        schema = get_any_json_object_schema();
+namespace {
+
+// Compiles valijson subschemas into CompiledSchema nodes, each subschema once, so that recursive schemas become cycles
+class SchemaCompiler {
+public:
+    // Schemas that accept any JSON value compile to any_json_schema. It is nullptr when compiling that schema itself.
+    SchemaCompiler(std::vector<std::unique_ptr<CompiledSchema>>& compiled_schemas, const CompiledSchema* any_json_schema)
+        : compiled_schemas(compiled_schemas), any_json_schema(any_json_schema) {}
+
+    const CompiledSchema* compile(JsonSchemaPtr schema) {
+        if (!schema) {
+            return compile_any_json();
+        }
+        auto it = compiled.find(schema);
+        if (it != compiled.end()) {
+            return it->second;
+        }
+
+        const AnyOfConstraint* anyOfConstraint = findConstraint<AnyOfConstraint>(schema);
+        const TypeConstraint* typeConstraint = findConstraint<TypeConstraint>(schema);
+        size_t num_constraints = typeConstraint ? typeConstraint->m_namedTypes.size() + typeConstraint->m_schemaTypes.size() : 0;
+        bool has_named_type = typeConstraint && (num_constraints != 1 || typeConstraint->m_namedTypes.size() == 1);
+        if (!anyOfConstraint && !has_named_type) {
+            const CompiledSchema* any_json = compile_any_json();
+            compiled[schema] = any_json;
+            return any_json;
+        }
+
+        // Registered before compiling the subschemas, which may lead back here
+        compiled_schemas.emplace_back(new CompiledSchema());
+        CompiledSchema* node = compiled_schemas.back().get();
+        compiled[schema] = node;
+
+        if (anyOfConstraint) {
+            node->kind = CompiledSchema::Kind::ANY_OF;
+            for (size_t i=0; i<anyOfConstraint->m_subschemas.size(); i++) {
+                node->any_of.push_back(compile(anyOfConstraint->m_subschemas.at(i)));
+            }
+            return node;
+        }
+
+        if (num_constraints != 1) {
+            node->error = "JsonSchemaParser: TypeConstraint has " + std::to_string(num_constraints) + " constraints, must have only 1";
+            return node;
+        }
+        auto type = *typeConstraint->m_namedTypes.begin();
+        if (const EnumConstraint* enumConstraint = findConstraint<EnumConstraint>(schema)) {
+            try {
+                compile_enum(node, getEnumValues(enumConstraint), type == TypeConstraint::kString);
+            } catch (const std::runtime_error& error) {
+                node->error = error.what();
+            }
+            return node;
+        }
+        switch (type) {
+            case TypeConstraint::kString:
+            {
+                const MinLengthConstraint* minLengthConstraint = findConstraint<MinLengthConstraint>(schema);
+                const MaxLengthConstraint* maxLengthConstraint = findConstraint<MaxLengthConstraint>(schema);
+                node->kind = CompiledSchema::Kind::STRING;
+                node->min_length = minLengthConstraint ? minLengthConstraint->getMinLength() : -1;
+                node->max_length = maxLengthConstraint ? maxLengthConstraint->getMaxLength() : -1;
+                break;
+            }
+            case TypeConstraint::kInteger:
+                node->kind = CompiledSchema::Kind::INTEGER;
+                break;
+            case TypeConstraint::kNumber:
+                node->kind = CompiledSchema::Kind::NUMBER;
+                break;
+            case TypeConstraint::kBoolean:
+                compile_enum(node, {"true", "false"}, false);
+                break;
+            case TypeConstraint::kNull:
+                compile_enum(node, {"null"}, false);
+                break;
+            case TypeConstraint::kObject:
+                compile_object(node, schema);
+                break;
+            case TypeConstraint::kArray:
+            {
+                const SingularItemsConstraint* singularItemsConstraint = findConstraint<SingularItemsConstraint>(schema);
+                const MinItemsConstraint* minItemsConstraint = findConstraint<MinItemsConstraint>(schema);
+                const MaxItemsConstraint* maxItemsConstraint = findConstraint<MaxItemsConstraint>(schema);
+                node->kind = CompiledSchema::Kind::ARRAY;
+                node->min_items = minItemsConstraint ? minItemsConstraint->getMinItems() : -1;
+                node->max_items = maxItemsConstraint ? maxItemsConstraint->getMaxItems() : -1;
+                node->items = singularItemsConstraint != nullptr ? compile(singularItemsConstraint->getItemsSubschema()) : compile_any_json();
+                break;
+            }
+            default:
+                node->error = "JsonSchemaParser: Unknown type constraint";
+        }
+        return node;
+    }
+
+private:
+    const CompiledSchema* compile_any_json() {
+        return any_json_schema ? any_json_schema : compile(get_any_json_object_schema());
     }
 
-    const AnyOfConstraint* anyOfConstraint = findConstraint<AnyOfConstraint>(schema);
-    const TypeConstraint* typeConstraint = findConstraint<TypeConstraint>(schema);
-    const EnumConstraint* enumConstraint = findConstraint<EnumConstraint>(schema);
-    const PropertiesConstraint* propertiesConstraint = findConstraint<PropertiesConstraint>(schema);
-    const PropertyNamesConstraint* propertyNamesConstraint = findConstraint<PropertyNamesConstraint>(schema);
-    const RequiredConstraint* requiredConstraint = findConstraint<RequiredConstraint>(schema);
+    // Without values, the value is free text (quoted or not)
+    static void compile_enum(CompiledSchema* node, const std::vector<std::string>& values, bool is_quoted) {
+        node->kind = CompiledSchema::Kind::ENUM;
+        node->enum_values = values.empty() ? nullptr : std::make_shared<const StringTrie>(values);
+        node->enum_is_quoted = is_quoted;
+    }
+
+    void compile_object(CompiledSchema* node, JsonSchemaPtr schema) {
+        const PropertiesConstraint* propertiesConstraint = findConstraint<PropertiesConstraint>(schema);
+        const RequiredConstraint* requiredConstraint = findConstraint<RequiredConstraint>(schema);
+        node->kind = CompiledSchema::Kind::OBJECT;
+        node->is_dictionary = (propertiesConstraint == nullptr)
+            || (propertiesConstraint->m_properties.size() + propertiesConstraint->m_patternProperties.size()) == 0;
 
-    if (anyOfConstraint) {
-        std::vector<CharacterLevelParserPtr> parsers;
-        for (size_t i=0; i<anyOfConstraint->m_subschemas.size(); i++) {
-            parsers.push_back(get_parser(parser, anyOfConstraint->m_subschemas.at(i)));
+        std::map<std::string, JsonSchemaPtr> property_schemas;
+        if (propertiesConstraint) {
+            for (const auto& property : propertiesConstraint->m_properties) {
+                property_schemas[std::string(property.first)] = property.second;
+            }
         }
-        return CharacterLevelParserPtr(new UnionParser((parsers)));
+        std::vector<std::string> required_keys;
+        if (requiredConstraint) {
+            required_keys.assign(requiredConstraint->m_requiredProperties.begin(), requiredConstraint->m_requiredProperties.end());
+        }
+        for (const auto& property : property_schemas) {
+            node->keys.push_back(property.first);
+        }
+        node->keys.insert(node->keys.end(), required_keys.begin(), required_keys.end());
+        std::sort(node->keys.begin(), node->keys.end());
+        node->keys.erase(std::unique(node->keys.begin(), node->keys.end()), node->keys.end());
+
+        std::size_t num_words = (node->keys.size() + 63) / 64;
+        node->required_keys.assign(num_words, 0);
+        node->property_keys.assign(num_words, 0);
+        for (const std::string& required_key : required_keys) {
+            int key_idx = node->find_key(required_key);
+            node->required_keys[key_idx / 64] |= uint64_t(1) << (key_idx % 64);
+        }
+        node->key_schemas.assign(node->keys.size(), nullptr);
+        for (const auto& property : property_schemas) {
+            int key_idx = node->find_key(property.first);
+            node->property_keys[key_idx / 64] |= uint64_t(1) << (key_idx % 64);
+            node->key_schemas[key_idx] = compile(property.second);
+        }
+        bool has_additional_properties = propertiesConstraint && propertiesConstraint->m_additionalProperties;
+        node->additional_properties = has_additional_properties ? compile(propertiesConstraint->m_additionalProperties) : compile_any_json();
     }
 
-    if (typeConstraint) {
-        size_t num_constraints = typeConstraint->m_namedTypes.size() + typeConstraint->m_schemaTypes.size();
-        if (num_constraints != 1) {
-            throw std::runtime_error("JsonSchemaParser: TypeConstraint has " + std::to_string(num_constraints) + " constraints, must have only 1");
-        }
-        if (typeConstraint->m_namedTypes.size() == 1) {
-            auto type = *typeConstraint->m_namedTypes.begin();
-            if (enumConstraint) {
-                bool needsQuotes = type == TypeConstraint::kString;
-                std::vector<std::string> enumValues = getEnumValues(enumConstraint);
-                return CharacterLevelParserPtr(new StringParsingState(parser, enumValues, needsQuotes, needsQuotes));
-            }
-            switch (type) {
-                case TypeConstraint::kString:
-                {
-                    const MinLengthConstraint* minLengthConstraint = findConstraint<MinLengthConstraint>(schema);
-                    const MaxLengthConstraint* maxLengthConstraint = findConstraint<MaxLengthConstraint>(schema);
-                    size_t min_length = minLengthConstraint ? minLengthConstraint->getMinLength() : -1;
-                    size_t max_length = maxLengthConstraint ? maxLengthConstraint->getMaxLength() : -1;
-                    return CharacterLevelParserPtr(new StringParsingState(parser, {}, true, true, min_length, max_length));
-                }
-                case TypeConstraint::kInteger:
-                    return CharacterLevelParserPtr(new NumberParsingState(parser, false));
-                case TypeConstraint::kNumber:
-                    return CharacterLevelParserPtr(new NumberParsingState(parser, true));
-                case TypeConstraint::kBoolean:
-                    return CharacterLevelParserPtr(new StringParsingState(parser, {"true", "false"}, false, false));
-                case TypeConstraint::kNull:
-                    return CharacterLevelParserPtr(new StringParsingState(parser, {"null"}, false, false));
-                case TypeConstraint::kObject:
-                    return CharacterLevelParserPtr(new ObjectParsingState(schema, parser));
-                case TypeConstraint::kArray:
-                {
-                    const SingularItemsConstraint* singularItemsConstraint = findConstraint<SingularItemsConstraint>(schema);
-                    const MinItemsConstraint* minItemsConstraint = findConstraint<MinItemsConstraint>(schema);
-                    const MaxItemsConstraint* maxItemsConstraint = findConstraint<MaxItemsConstraint>(schema);
-                    JsonSchemaPtr list_member_type = (singularItemsConstraint != nullptr) ? singularItemsConstraint->getItemsSubschema() : get_any_json_object_schema();
-                    size_t minItems = minItemsConstraint ? minItemsConstraint->getMinItems() : -1;
-                    size_t maxItems = maxItemsConstraint ? maxItemsConstraint->getMaxItems() : -1;
-                    return CharacterLevelParserPtr(new ListParsingState(parser, list_member_type, minItems, maxItems));
-                }
-                default:
-                    throw std::runtime_error("JsonSchemaParser: Unknown type constraint");
-                }
-        } else {
-            auto schemaType = typeConstraint->m_schemaTypes[0];
+    std::vector<std::unique_ptr<CompiledSchema>>& compiled_schemas;
+    const CompiledSchema* any_json_schema;
+    std::unordered_map<JsonSchemaPtr, const CompiledSchema*> compiled;
+};
+
+// Shared by every parser, like the valijson schema it is compiled from
+const CompiledSchema* get_any_json_compiled_schema()
+{
+    static std::vector<std::unique_ptr<CompiledSchema>> compiled_schemas;
+    static const CompiledSchema* any_json_compiled_schema = SchemaCompiler(compiled_schemas, nullptr).compile(get_any_json_object_schema());
+    return any_json_compiled_schema;
+}
+
+}
+
+const uint32_t StringTrie::ROOT;
+const uint32_t StringTrie::NO_NODE;
+
+StringTrie::StringTrie(std::vector<std::string> strings) : strings(std::move(strings)), hash(0) {
+    std::sort(this->strings.begin(), this->strings.end());
+    this->strings.erase(std::unique(this->strings.begin(), this->strings.end()), this->strings.end());
+    nodes.push_back(Node{CharacterSet(), false, {}});
+    for (const std::string& string : this->strings) {
+        hash_combine(hash, std::hash<std::string>()(string));
+        uint32_t node = ROOT;
+        for (char character : string) {
+            uint32_t child = find_child(node, character);
+            if (child == NO_NODE) {
+                child = static_cast<uint32_t>(nodes.size());
+                nodes.push_back(Node{CharacterSet(), false, {}});
+                nodes[node].next_characters.add(character);
+                nodes[node].children.emplace_back(character, child);
+            }
+            node = child;
         }
+        nodes[node].is_string_end = true;
     }
+}
 
-    return get_parser(parser, get_any_json_object_schema());
+uint32_t StringTrie::find_child(uint32_t node, char character) const {
+    if (node == NO_NODE || !nodes[node].next_characters.contains(character)) {
+        return NO_NODE;
+    }
+    for (const auto& child : nodes[node].children) {
+        if (child.first == character) {
+            return child.second;
+        }
+    }
+    return NO_NODE;
 }
 
+int CompiledSchema::find_key(const std::string& key) const {
+    auto it = std::lower_bound(keys.begin(), keys.end(), key);
+    return it != keys.end() && *it == key ? static_cast<int>(it - keys.begin()) : -1;
+}
 
-JsonSchemaParser::JsonSchemaParser(const std::string& schema_string, CharacterLevelParserConfig* config) : config(config) {
-    context = std::make_shared<_Context>();
-    json schema_json = json::parse(schema_string.empty() ? _ANY_JSON_SCHEMA_STRING : schema_string);
+CharacterLevelParserPtr get_parser(JsonSchemaParser *parser, const CompiledSchema *schema)
+{
+    switch (schema->kind) {
+        case CompiledSchema::Kind::ANY_OF:
+        {
+            std::vector<CharacterLevelParserPtr> parsers;
+            for (const CompiledSchema* subschema : schema->any_of) {
+                parsers.push_back(get_parser(parser, subschema));
+            }
+            return CharacterLevelParserPtr(new UnionParser((parsers)));
+        }
+        case CompiledSchema::Kind::ENUM:
+            return CharacterLevelParserPtr(new StringParsingState(parser, schema->enum_values, schema->enum_is_quoted, schema->enum_is_quoted));
+        case CompiledSchema::Kind::STRING:
+            return CharacterLevelParserPtr(new StringParsingState(parser, nullptr, true, true, schema->min_length, schema->max_length));
+        case CompiledSchema::Kind::INTEGER:
+            return CharacterLevelParserPtr(new NumberParsingState(parser, false));
+        case CompiledSchema::Kind::NUMBER:
+            return CharacterLevelParserPtr(new NumberParsingState(parser, true));
+        case CompiledSchema::Kind::OBJECT:
+            return CharacterLevelParserPtr(new ObjectParsingState(schema, parser));
+        case CompiledSchema::Kind::ARRAY:
+            return CharacterLevelParserPtr(new ListParsingState(parser, schema->items, schema->min_items, schema->max_items));
+        default:
+            throw std::runtime_error(schema->error);
+    }
+}
+
+
+JsonSchemaParser::JsonSchemaParser(const std::string& schema_string, CharacterLevelParserConfig* config)
+    : JsonSchemaParser(JsonSchemaRegistry::get_global().get_context(schema_string), config) {
+}
+
+JsonSchemaParser::JsonSchemaParser(ContextPtr context, CharacterLevelParserConfig* config) : context(context), config(config) {
+    num_consecutive_whitespaces = 0;
+    last_parsed_string = "";
+    last_non_whitespace_character = "";
+    object_stack.push(get_parser(this, context->root_schema));
+}
+
+JsonSchemaParser::ContextPtr JsonSchemaParser::create_context(const json& schema_json) {
+    std::shared_ptr<_Context> context = std::make_shared<_Context>();
     valijson::adapters::NlohmannJsonAdapter schema_adapter(schema_json);
     valijson::SchemaParser parser;
     parser.populateSchema(schema_adapter, context->model_class);
-    context->active_parser = this;
-    context->alphabet_without_quotes = COMPLETE_ALPHABET;
+    context->alphabet_without_quotes = COMPLETE_ALPHABET + WHITESPACE_CHARACTERS;
     //https://stackoverflow.com/a/20326454/1075114
     context->alphabet_without_quotes.erase(
         std::remove(context->alphabet_without_quotes.begin(), context->alphabet_without_quotes.end(), '"'),
         context->alphabet_without_quotes.end());
+    context->string_characters = CharacterSet(context->alphabet_without_quotes).add('\\');
 
-    num_consecutive_whitespaces = 0;
-    last_parsed_string = "";
-    last_non_whitespace_character = "";
-    object_stack.push_back(get_parser(this, &context->model_class));
+    SchemaCompiler compiler(context->compiled_schemas, get_any_json_compiled_schema());
+    context->root_schema = compiler.compile(&context->model_class);
+    return context;
+}
+
+const std::size_t JsonSchemaRegistry::DEFAULT_MAX_ENTRIES;
+
+JsonSchemaRegistry::JsonSchemaRegistry(std::size_t max_entries) {
+    set_max_entries(max_entries);
+}
+
+JsonSchemaParser::ContextPtr JsonSchemaRegistry::get_context(const std::string& schema_string) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string* canonical_string = canonical_strings.get(schema_string);
+        if (canonical_string != nullptr) {
+            JsonSchemaParser::ContextPtr* context = contexts.get(*canonical_string);
+            if (context != nullptr) {
+                return *context;
+            }
+        }
+    }
+
+    // Parsed and compiled outside of the lock, so that a new schema does not hold up the parsers of known ones
+    json schema_json = json::parse(schema_string.empty() ? _ANY_JSON_SCHEMA_STRING : schema_string);
+    std::string canonical_string = schema_json.dump();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        canonical_strings.put(schema_string, canonical_string, 1);
+        JsonSchemaParser::ContextPtr* context = contexts.get(canonical_string);
+        if (context != nullptr) {
+            evict();
+            return *context;
+        }
+    }
+    JsonSchemaParser::ContextPtr context = JsonSchemaParser::create_context(schema_json);
+    std::lock_guard<std::mutex> lock(mutex);
+    // Another thread may have compiled the same schema in the meantime, its context is the one to share
+    JsonSchemaParser::ContextPtr* existing_context = contexts.get(canonical_string);
+    if (existing_context != nullptr) {
+        return *existing_context;
+    }
+    contexts.put(canonical_string, context, 1);
+    evict();
+    return context;
+}
+
+void JsonSchemaRegistry::set_max_entries(std::size_t max_entries) {
+    std::lock_guard<std::mutex> lock(mutex);
+    contexts.set_limits(max_entries, 0);
+    // Several spellings of a schema may point at the same context
+    canonical_strings.set_limits(max_entries * 4, 0);
+    evict();
+}
+
+void JsonSchemaRegistry::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    contexts.clear();
+    canonical_strings.clear();
+}
+
+std::size_t JsonSchemaRegistry::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return contexts.size();
+}
+
+JsonSchemaRegistry& JsonSchemaRegistry::get_global() {
+    static JsonSchemaRegistry global_registry;
+    return global_registry;
+}
+
+// Contexts that parsers still hold stay, the registry would only lose track of them
+void JsonSchemaRegistry::evict() {
+    contexts.evict([](const std::string&, const JsonSchemaParser::ContextPtr& context) { return context.use_count() == 1; });
+    canonical_strings.evict([](const std::string&, const std::string&) { return true; });
 }
 
 CharacterLevelParserPtr JsonSchemaParser::add_character(char new_character) {
-    context->active_parser = const_cast<JsonSchemaParser*>(this);
-    int receiving_idx = object_stack.size() - 1;
+    active_parser = const_cast<JsonSchemaParser*>(this);
+    // Parsers above the one that receives the character are finished, and popped
+    ParserStack receiving_stack = object_stack;
     std::string last_parsed_string = this->last_parsed_string;
-    bool found_receiving_idx = false;
-    while (!found_receiving_idx) {
-        if (object_stack[receiving_idx]->get_allowed_characters().find(new_character) != std::string::npos) {
-            found_receiving_idx = true;
+    while (!receiving_stack.top()->get_allowed_character_set().contains(new_character)) {
+        if (receiving_stack.size() == 1) {
+            throw std::runtime_error(std::string("JsonSchemaParser: Character '") + new_character + "' is not allowed");
         }
-        else {
-            CharacterLevelParserPtr finished_receiver = object_stack[receiving_idx];
-            if (StringParsingState* string_parser = dynamic_cast<StringParsingState*>(finished_receiver.get())) {
-                last_parsed_string = string_parser->parsed_string;
-            }
-            receiving_idx--;
+        if (StringParsingState* string_parser = dynamic_cast<StringParsingState*>(receiving_stack.top().get())) {
+            last_parsed_string = string_parser->parsed_string;
         }
+        receiving_stack.pop();
     }
 
-    std::vector<CharacterLevelParserPtr> updated_stack(object_stack.begin(), object_stack.begin() + receiving_idx + 1);
-    JsonSchemaParser* updated_parser = new JsonSchemaParser(context, config, updated_stack, num_consecutive_whitespaces);
-    updated_parser->context->active_parser = updated_parser;
+    JsonSchemaParser* updated_parser = new JsonSchemaParser(context, config, receiving_stack, num_consecutive_whitespaces);
+    active_parser = updated_parser;
     updated_parser->last_parsed_string = last_parsed_string;
-    updated_parser->object_stack[receiving_idx] = updated_parser->object_stack[receiving_idx]->add_character(new_character);
+    CharacterLevelParserPtr updated_receiver = receiving_stack.top()->add_character(new_character);
+    // The receiver may have pushed the parser of a nested value, which goes above the receiver's new state
+    ParserStack& updated_stack = updated_parser->object_stack;
+    std::vector<CharacterLevelParserPtr> pushed_parsers;
+    while (updated_stack.size() > receiving_stack.size()) {
+        pushed_parsers.push_back(updated_stack.top());
+        updated_stack.pop();
+    }
+    updated_stack.pop();
+    updated_stack.push(updated_receiver);
+    for (auto it = pushed_parsers.rbegin(); it != pushed_parsers.rend(); ++it) {
+        updated_stack.push(*it);
+    }
     if (std::find(WHITESPACE_CHARACTERS.begin(), WHITESPACE_CHARACTERS.end(), new_character) != WHITESPACE_CHARACTERS.end()) {
         updated_parser->num_consecutive_whitespaces++;
     }
@@ -673,39 +1193,102 @@ CharacterLevelParserPtr JsonSchemaParser::add_character(char new_character) {
     return CharacterLevelParserPtr(updated_parser);
 }
 
-std::string JsonSchemaParser::get_allowed_characters() const {
-    context->active_parser = const_cast<JsonSchemaParser*>(this);
+// Runs of string contents and digits go to the state on top of the stack in one step, other characters one at a time
+CharacterLevelParserPtr JsonSchemaParser::add_string(std::string_view characters) {
+    CharacterLevelParserPtr parser = shared_from_this();
+    std::size_t position = 0;
+    while (position < characters.size()) {
+        JsonSchemaParser* json_parser = static_cast<JsonSchemaParser*>(parser.get());
+        std::size_t run_length = json_parser->_get_contents_run_length(characters.substr(position));
+        if (run_length > 1) {
+            parser = json_parser->_add_contents_run(characters.substr(position, run_length));
+            position += run_length;
+            continue;
+        }
+        if (!parser->get_allowed_character_set().contains(characters[position])) {
+            return nullptr;
+        }
+        parser = parser->add_character(characters[position]);
+        position++;
+    }
+    return parser;
+}
 
-    std::vector<std::string> allowed_character_strs;
-    for (auto it = object_stack.rbegin(); it != object_stack.rend(); ++it) {
-        // Similar to SequenceParser, if the top object can end, we need to know to accept the next character of parser below, etc.
-        allowed_character_strs.push_back((*it)->get_allowed_characters());
-        if (!(*it)->can_end()) {
-            break;
+std::size_t JsonSchemaParser::_get_contents_run_length(std::string_view characters) const {
+    const PrimitiveParsingState* top_state = dynamic_cast<const PrimitiveParsingState*>(object_stack.top().get());
+    if (top_state == nullptr) {
+        return 0;
+    }
+    std::size_t run_length = top_state->get_contents_run_length(characters);
+    // Whitespace runs are limited here, and not by the parsing state
+    int whitespace_run = num_consecutive_whitespaces;
+    for (std::size_t char_idx = 0; char_idx < run_length; ++char_idx) {
+        if (!WHITESPACE_CHARACTER_SET.contains(characters[char_idx])) {
+            whitespace_run = 0;
+        } else if (whitespace_run++ >= MAX_CONSECUTIVE_WHITESPACES) {
+            return char_idx;
         }
     }
-    std::string allowed_characters;
-    if (allowed_character_strs.size() > 0) {
-        allowed_characters = std::accumulate(allowed_character_strs.begin(), allowed_character_strs.end(), std::string());
+    return run_length;
+}
+
+// Same as adding the characters one by one, see add_character()
+CharacterLevelParserPtr JsonSchemaParser::_add_contents_run(std::string_view characters) {
+    JsonSchemaParser* updated_parser = new JsonSchemaParser(context, config, object_stack, num_consecutive_whitespaces);
+    CharacterLevelParserPtr result(updated_parser);
+    active_parser = updated_parser;
+    updated_parser->last_parsed_string = last_parsed_string;
+    CharacterLevelParserPtr updated_top = object_stack.top()->add_string(characters);
+    updated_parser->object_stack.pop();
+    updated_parser->object_stack.push(updated_top);
+    for (char character : characters) {
+        if (WHITESPACE_CHARACTER_SET.contains(character)) {
+            updated_parser->num_consecutive_whitespaces++;
+        } else {
+            updated_parser->num_consecutive_whitespaces = 0;
+        }
     }
-    else {
+    if (!WHITESPACE_CHARACTER_SET.contains(characters.back())) {
+        updated_parser->last_non_whitespace_character = characters.back();
+    }
+    return result;
+}
+
+CharacterSet JsonSchemaParser::get_allowed_character_set() const {
+    // The parser is not changed after add_character() returns it, so the set is computed once
+    std::call_once(allowed_characters_once, [this]() {
+        allowed_characters = _compute_allowed_character_set();
+    });
+    return allowed_characters;
+}
+
+CharacterSet JsonSchemaParser::_compute_allowed_character_set() const {
+    active_parser = const_cast<JsonSchemaParser*>(this);
+
+    if (object_stack.empty()) {
         // In certain cases, beam search / sample crashes when there are less legal 
         // continuation tokens than there are beams. Therefore, we allow whitespace 
         // characters when the object stack is empty (= we are done parsing)
-        allowed_characters = WHITESPACE_CHARACTERS;
+        return num_consecutive_whitespaces >= MAX_CONSECUTIVE_WHITESPACES ? CharacterSet() : WHITESPACE_CHARACTER_SET;
+    }
+    CharacterSet allowed_characters;
+    for (const CharacterLevelParserPtr& parser : object_stack) {
+        // Similar to SequenceParser, if the top object can end, we need to know to accept the next character of parser below, etc.
+        allowed_characters |= parser->get_allowed_character_set();
+        if (!parser->can_end()) {
+            break;
+        }
     }
 
     if (num_consecutive_whitespaces >= MAX_CONSECUTIVE_WHITESPACES) {
-        allowed_characters.erase(std::remove_if(allowed_characters.begin(), allowed_characters.end(), [](char c) {
-            return std::find(WHITESPACE_CHARACTERS.begin(), WHITESPACE_CHARACTERS.end(), c) != WHITESPACE_CHARACTERS.end();
-        }), allowed_characters.end());
+        allowed_characters -= WHITESPACE_CHARACTER_SET;
     }
     return allowed_characters;
 }
 
 bool JsonSchemaParser::can_end() const
 {
-    for (auto parser : object_stack) {
+    for (const CharacterLevelParserPtr& parser : object_stack) {
         if (!parser->can_end()) {
             return false;
         }
@@ -713,17 +1296,82 @@ bool JsonSchemaParser::can_end() const
     return true;
 }
 
-JsonSchemaPtr _ANY_JSON_OBJECT_SCHEMA;
+// The parser on top of the stack receives every character it allows, so its shortcut (free text, digits) holds here as well.
+// Whitespace runs are only tracked here, so a string that is in the middle of one is walked normally.
+// Otherwise, every JSON state that accepts whitespace keeps accepting it, so whitespace tokens only depend on the run limit.
+ShortcutKey JsonSchemaParser::shortcut_key() const
+{
+    if (object_stack.empty()) {
+        return ShortcutKey();
+    }
+    ShortcutKey key = object_stack.top()->shortcut_key();
+    if (key.kind != ShortcutKey::Kind::NONE) {
+        if (!key.run_limited_characters.empty() && num_consecutive_whitespaces != 0) {
+            return ShortcutKey();
+        }
+        return key;
+    }
+    if (num_consecutive_whitespaces >= MAX_CONSECUTIVE_WHITESPACES) {
+        return key;
+    }
+    if (!get_allowed_character_set().contains_all(WHITESPACE_CHARACTER_SET)) {
+        return key;
+    }
+    key.kind = ShortcutKey::Kind::CHARACTER_CLASS;
+    key.character_class = WHITESPACE_CHARACTERS;
+    key.run_limited_characters = WHITESPACE_CHARACTERS;
+    key.max_run = MAX_CONSECUTIVE_WHITESPACES - num_consecutive_whitespaces;
+    return key;
+}
+
+// Parsing states hold CompiledSchema pointers, which stay valid (and unique) because this parser keeps its context alive.
+// last_non_whitespace_character is left out since the parsing states only read it from their root parser.
+std::size_t JsonSchemaParser::cache_key() const
+{
+    std::size_t key = type_cache_key();
+    for (const CharacterLevelParserPtr& parser : object_stack) {
+        std::size_t parser_key = parser->cache_key();
+        if (parser_key == 0) {
+            return 0;
+        }
+        hash_combine(key, parser_key);
+    }
+    hash_combine(key, std::min(num_consecutive_whitespaces, MAX_CONSECUTIVE_WHITESPACES));
+    hash_combine(key, std::hash<std::string>()(last_parsed_string));
+    return nonzero_cache_key(key);
+}
+
+bool JsonSchemaParser::cache_equals(const CharacterLevelParser& other) const
+{
+    if (typeid(other) != typeid(*this)) {
+        return false;
+    }
+    const JsonSchemaParser& other_parser = static_cast<const JsonSchemaParser&>(other);
+    if (std::min(num_consecutive_whitespaces, MAX_CONSECUTIVE_WHITESPACES) != std::min(other_parser.num_consecutive_whitespaces, MAX_CONSECUTIVE_WHITESPACES) ||
+        last_parsed_string != other_parser.last_parsed_string ||
+        object_stack.size() != other_parser.object_stack.size()) {
+        return false;
+    }
+    // Sibling states share the frames below the one they changed, and shared frames are equal as a whole
+    ParserStack::const_iterator it = object_stack.begin(), other_it = other_parser.object_stack.begin();
+    for (; it != object_stack.end() && it != other_it; ++it, ++other_it) {
+        if (!(*it)->cache_equals(**other_it)) {
+            return false;
+        }
+    }
+    return true;
+}
 
 JsonSchemaPtr get_any_json_object_schema()
 {
-    if (_ANY_JSON_OBJECT_SCHEMA == nullptr) {
+    // Function local static, so that concurrent first calls are initialized exactly once
+    static JsonSchemaPtr any_json_object_schema = []() {
         json schema_json = json::parse(_ANY_JSON_SCHEMA_STRING);
         valijson::adapters::NlohmannJsonAdapter schema_adapter(schema_json);
         valijson::SchemaParser parser;
         valijson::Schema* schema = new valijson::Schema();
         parser.populateSchema(schema_adapter, *schema);
-        _ANY_JSON_OBJECT_SCHEMA = schema;
-    }
-    return _ANY_JSON_OBJECT_SCHEMA;
+        return schema;
+    }();
+    return any_json_object_schema;
 }
\ No newline at end of file
@@ -0,0 +1,266 @@
+#include "lmfe/logitsmasking.hpp"
+
+#include <atomic>
+#include <limits>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LMFE_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+typedef TokenBitmask::Word Word;
+
+const uint16_t FP16_NEGATIVE_INFINITY = 0xFC00;
+const uint16_t BF16_NEGATIVE_INFINITY = 0xFF80;
+const int BITS_PER_WORD = TokenBitmask::BITS_PER_WORD;
+
+// Masks whole words [first_word, last_word) of the bitmask, bit by bit
+template <class T>
+static void mask_words_scalar(T* logits, const Word* bitmask, std::size_t first_word, std::size_t last_word, T negative_infinity) {
+    for (std::size_t word_idx = first_word; word_idx < last_word; ++word_idx) {
+        Word word = bitmask[word_idx];
+        if (word == ~Word(0)) {
+            continue;
+        }
+        T* word_logits = logits + word_idx * BITS_PER_WORD;
+        if (word == 0) {
+            std::fill(word_logits, word_logits + BITS_PER_WORD, negative_infinity);
+            continue;
+        }
+        // Partial words are close to random at mid densities, so avoid a branch per bit
+        T values[BITS_PER_WORD];
+        std::copy(word_logits, word_logits + BITS_PER_WORD, values);
+        for (int bit = 0; bit < BITS_PER_WORD; ++bit) {
+            const T candidates[2] = {negative_infinity, values[bit]};
+            word_logits[bit] = candidates[(word >> bit) & 1];
+        }
+    }
+}
+
+#ifdef LMFE_X86_DISPATCH
+
+__attribute__((target("avx2")))
+static void mask_words_f32_avx2(float* logits, const Word* bitmask, std::size_t num_words) {
+    const __m256i bit_select = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 negative_infinity = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+    for (std::size_t word_idx = 0; word_idx < num_words; ++word_idx) {
+        Word word = bitmask[word_idx];
+        if (word == ~Word(0)) {
+            continue;
+        }
+        float* word_logits = logits + word_idx * BITS_PER_WORD;
+        for (int lane = 0; lane < 4; ++lane) {
+            __m256i bits = _mm256_set1_epi32((word >> (8 * lane)) & 0xFF);
+            __m256i keep = _mm256_cmpeq_epi32(_mm256_and_si256(bits, bit_select), bit_select);
+            __m256 values = _mm256_loadu_ps(word_logits + 8 * lane);
+            _mm256_storeu_ps(word_logits + 8 * lane, _mm256_blendv_ps(negative_infinity, values, _mm256_castsi256_ps(keep)));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void mask_words_16bit_avx2(uint16_t* logits, const Word* bitmask, std::size_t num_words, uint16_t negative_infinity_bits) {
+    const __m256i bit_select = _mm256_setr_epi16(
+        0x0001, 0x0002, 0x0004, 0x0008, 0x0010, 0x0020, 0x0040, 0x0080,
+        0x0100, 0x0200, 0x0400, 0x0800, 0x1000, 0x2000, 0x4000, (short)0x8000);
+    const __m256i negative_infinity = _mm256_set1_epi16((short)negative_infinity_bits);
+    for (std::size_t word_idx = 0; word_idx < num_words; ++word_idx) {
+        Word word = bitmask[word_idx];
+        if (word == ~Word(0)) {
+            continue;
+        }
+        uint16_t* word_logits = logits + word_idx * BITS_PER_WORD;
+        for (int lane = 0; lane < 2; ++lane) {
+            __m256i bits = _mm256_set1_epi16((short)((word >> (16 * lane)) & 0xFFFF));
+            __m256i keep = _mm256_cmpeq_epi16(_mm256_and_si256(bits, bit_select), bit_select);
+            __m256i* address = reinterpret_cast<__m256i*>(word_logits + 16 * lane);
+            __m256i values = _mm256_loadu_si256(address);
+            _mm256_storeu_si256(address, _mm256_blendv_epi8(negative_infinity, values, keep));
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void mask_words_f32_avx512(float* logits, const Word* bitmask, std::size_t num_words) {
+    const __m512 negative_infinity = _mm512_set1_ps(-std::numeric_limits<float>::infinity());
+    for (std::size_t word_idx = 0; word_idx < num_words; ++word_idx) {
+        Word word = bitmask[word_idx];
+        if (word == ~Word(0)) {
+            continue;
+        }
+        float* word_logits = logits + word_idx * BITS_PER_WORD;
+        _mm512_mask_storeu_ps(word_logits, (__mmask16)~(word & 0xFFFF), negative_infinity);
+        _mm512_mask_storeu_ps(word_logits + 16, (__mmask16)~(word >> 16), negative_infinity);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void mask_words_16bit_avx512(uint16_t* logits, const Word* bitmask, std::size_t num_words, uint16_t negative_infinity_bits) {
+    const __m512i negative_infinity = _mm512_set1_epi16((short)negative_infinity_bits);
+    for (std::size_t word_idx = 0; word_idx < num_words; ++word_idx) {
+        Word word = bitmask[word_idx];
+        if (word == ~Word(0)) {
+            continue;
+        }
+        _mm512_mask_storeu_epi16(logits + word_idx * BITS_PER_WORD, (__mmask32)~word, negative_infinity);
+    }
+}
+
+static bool cpu_supports(LogitsMaskingImplementation implementation) {
+    __builtin_cpu_init();
+    switch (implementation) {
+        case LogitsMaskingImplementation::AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+        case LogitsMaskingImplementation::AVX2:
+            return __builtin_cpu_supports("avx2");
+        default:
+            return true;
+    }
+}
+
+#else
+
+static bool cpu_supports(LogitsMaskingImplementation implementation) {
+    return implementation == LogitsMaskingImplementation::SCALAR;
+}
+
+#endif
+
+static LogitsMaskingImplementation best_supported_implementation(LogitsMaskingImplementation requested) {
+    const LogitsMaskingImplementation preference[] = {
+        LogitsMaskingImplementation::AVX512,
+        LogitsMaskingImplementation::AVX2,
+        LogitsMaskingImplementation::SCALAR
+    };
+    bool reached_requested = requested == LogitsMaskingImplementation::AUTO;
+    for (LogitsMaskingImplementation candidate : preference) {
+        reached_requested = reached_requested || candidate == requested;
+        if (reached_requested && cpu_supports(candidate)) {
+            return candidate;
+        }
+    }
+    return LogitsMaskingImplementation::SCALAR;
+}
+
+static std::atomic<LogitsMaskingImplementation>& active_implementation() {
+    static std::atomic<LogitsMaskingImplementation> implementation(best_supported_implementation(LogitsMaskingImplementation::AUTO));
+    return implementation;
+}
+
+LogitsMaskingImplementation select_logits_masking_implementation(LogitsMaskingImplementation requested) {
+    LogitsMaskingImplementation implementation = best_supported_implementation(requested);
+    active_implementation().store(implementation);
+    return implementation;
+}
+
+LogitsMaskingImplementation get_logits_masking_implementation() {
+    return active_implementation().load(std::memory_order_relaxed);
+}
+
+// Handles the parts of the row that are not covered by whole bitmask words:
+// the trailing partial word, and logits beyond the end of the bitmask.
+template <class T>
+static void mask_tail(T* logits, std::size_t num_logits, const Word* bitmask, std::size_t bitmask_bits, std::size_t first_token, T negative_infinity) {
+    std::size_t covered = std::min(num_logits, bitmask_bits);
+    for (std::size_t token_id = first_token; token_id < covered; ++token_id) {
+        if (!((bitmask[token_id / BITS_PER_WORD] >> (token_id % BITS_PER_WORD)) & 1)) {
+            logits[token_id] = negative_infinity;
+        }
+    }
+    if (covered < num_logits) {
+        std::fill(logits + covered, logits + num_logits, negative_infinity);
+    }
+}
+
+void apply_token_bitmask_inplace(float* logits, std::size_t num_logits, const Word* bitmask, std::size_t bitmask_bits) {
+    std::size_t num_words = std::min(num_logits, bitmask_bits) / BITS_PER_WORD;
+    switch (get_logits_masking_implementation()) {
+#ifdef LMFE_X86_DISPATCH
+        case LogitsMaskingImplementation::AVX512:
+            mask_words_f32_avx512(logits, bitmask, num_words);
+            break;
+        case LogitsMaskingImplementation::AVX2:
+            mask_words_f32_avx2(logits, bitmask, num_words);
+            break;
+#endif
+        default:
+            mask_words_scalar(logits, bitmask, 0, num_words, -std::numeric_limits<float>::infinity());
+            break;
+    }
+    mask_tail(logits, num_logits, bitmask, bitmask_bits, num_words * BITS_PER_WORD, -std::numeric_limits<float>::infinity());
+}
+
+static void apply_token_bitmask_inplace_16bit(uint16_t* logits, std::size_t num_logits, const Word* bitmask, std::size_t bitmask_bits, uint16_t negative_infinity) {
+    std::size_t num_words = std::min(num_logits, bitmask_bits) / BITS_PER_WORD;
+    switch (get_logits_masking_implementation()) {
+#ifdef LMFE_X86_DISPATCH
+        case LogitsMaskingImplementation::AVX512:
+            mask_words_16bit_avx512(logits, bitmask, num_words, negative_infinity);
+            break;
+        case LogitsMaskingImplementation::AVX2:
+            mask_words_16bit_avx2(logits, bitmask, num_words, negative_infinity);
+            break;
+#endif
+        default:
+            mask_words_scalar(logits, bitmask, 0, num_words, negative_infinity);
+            break;
+    }
+    mask_tail(logits, num_logits, bitmask, bitmask_bits, num_words * BITS_PER_WORD, negative_infinity);
+}
+
+void apply_token_bitmask_inplace_fp16(uint16_t* logits, std::size_t num_logits, const Word* bitmask, std::size_t bitmask_bits) {
+    apply_token_bitmask_inplace_16bit(logits, num_logits, bitmask, bitmask_bits, FP16_NEGATIVE_INFINITY);
+}
+
+void apply_token_bitmask_inplace_bf16(uint16_t* logits, std::size_t num_logits, const Word* bitmask, std::size_t bitmask_bits) {
+    apply_token_bitmask_inplace_16bit(logits, num_logits, bitmask, bitmask_bits, BF16_NEGATIVE_INFINITY);
+}
+
+// Handles the list forms of a TokenMask, returns false if the mask is dense
+template <class T>
+static bool apply_token_list_mask(T* logits, std::size_t num_logits, const TokenMask& mask, T negative_infinity) {
+    const std::vector<int>& token_ids = mask.get_token_ids();
+    std::size_t covered = std::min(num_logits, mask.size());
+    if (mask.get_kind() == TokenMask::Kind::DENY_LIST) {
+        for (int token_id : token_ids) {
+            if (static_cast<std::size_t>(token_id) < covered) {
+                logits[token_id] = negative_infinity;
+            }
+        }
+    } else if (mask.get_kind() == TokenMask::Kind::ALLOW_LIST) {
+        std::size_t gap_start = 0;
+        for (int token_id : token_ids) {
+            if (static_cast<std::size_t>(token_id) >= covered) {
+                break;
+            }
+            std::fill(logits + gap_start, logits + token_id, negative_infinity);
+            gap_start = token_id + 1;
+        }
+        std::fill(logits + std::min(gap_start, covered), logits + covered, negative_infinity);
+    } else {
+        return false;
+    }
+    if (covered < num_logits) {
+        std::fill(logits + covered, logits + num_logits, negative_infinity);
+    }
+    return true;
+}
+
+void apply_token_mask_inplace(float* logits, std::size_t num_logits, const TokenMask& mask) {
+    if (!apply_token_list_mask(logits, num_logits, mask, -std::numeric_limits<float>::infinity())) {
+        apply_token_bitmask_inplace(logits, num_logits, mask.get_bitmask());
+    }
+}
+
+void apply_token_mask_inplace_fp16(uint16_t* logits, std::size_t num_logits, const TokenMask& mask) {
+    if (!apply_token_list_mask(logits, num_logits, mask, FP16_NEGATIVE_INFINITY)) {
+        apply_token_bitmask_inplace_fp16(logits, num_logits, mask.get_bitmask());
+    }
+}
+
+void apply_token_mask_inplace_bf16(uint16_t* logits, std::size_t num_logits, const TokenMask& mask) {
+    if (!apply_token_list_mask(logits, num_logits, mask, BF16_NEGATIVE_INFINITY)) {
+        apply_token_bitmask_inplace_bf16(logits, num_logits, mask.get_bitmask());
+    }
+}
@@ -0,0 +1,79 @@
+#include "lmfe/mappedfile.hpp"
+#include "lmfe/exceptions.hpp"
+
+#include <cstring>
+#include <fstream>
+
+#if defined(_WIN32)
+#define LMFE_HAS_MMAP 0
+#else
+#define LMFE_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile(const std::string& path) : file_data(nullptr), file_size(0), is_mapped(false) {
+#if LMFE_HAS_MMAP
+    int file_descriptor = ::open(path.c_str(), O_RDONLY);
+    if (file_descriptor < 0) {
+        throw LMFormatEnforcerException("Could not open " + path);
+    }
+    struct stat file_stat;
+    if (::fstat(file_descriptor, &file_stat) != 0) {
+        ::close(file_descriptor);
+        throw LMFormatEnforcerException("Could not read the size of " + path);
+    }
+    file_size = static_cast<std::size_t>(file_stat.st_size);
+    if (file_size > 0) {
+        void* mapping = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+        if (mapping != MAP_FAILED) {
+            file_data = static_cast<const char*>(mapping);
+            is_mapped = true;
+        }
+    }
+    ::close(file_descriptor);
+    if (is_mapped || file_size == 0) {
+        return;
+    }
+#endif
+    // Platforms without mmap, and files that could not be mapped
+    std::ifstream stream(path, std::ios::binary);
+    if (!stream) {
+        throw LMFormatEnforcerException("Could not open " + path);
+    }
+    buffer.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    if (stream.bad()) {
+        throw LMFormatEnforcerException("Could not read " + path);
+    }
+    file_data = buffer.data();
+    file_size = buffer.size();
+}
+
+MappedFile::~MappedFile() {
+#if LMFE_HAS_MMAP
+    if (is_mapped) {
+        ::munmap(const_cast<char*>(file_data), file_size);
+    }
+#endif
+}
+
+uint64_t checksum64(const void* data, std::size_t size, uint64_t seed) {
+    const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = seed ^ (size * multiplier);
+    std::size_t position = 0;
+    for (; position + sizeof(uint64_t) <= size; position += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, bytes + position, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    if (position < size) {
+        std::memcpy(&tail, bytes + position, size - position);
+    }
+    hash = (hash ^ tail) * multiplier;
+    return hash ^ (hash >> 32);
+}
@@ -1 +1,286 @@
 #include <iostream>
+#include <algorithm>
+#include "lmfe/tokenenforcer.hpp"
+
+static void write_mask_row(const TokenMask& mask, TokenBitmask::Word* output_row, std::size_t output_row_words) {
+    const std::size_t mask_words = TokenBitmask::num_words(mask.size());
+    if (mask_words > output_row_words) {
+        throw LMFormatEnforcerException("Output rows are narrower than the vocabulary bitmask");
+    }
+    mask.write_bitmask(output_row);
+    std::fill(output_row + mask_words, output_row + output_row_words, 0);
+}
+
+void TokenEnforcer::get_allowed_tokens_batch(TokenEnforcer* const* enforcers,
+                                             std::size_t batch_size,
+                                             const int* token_ids,
+                                             const std::size_t* offsets,
+                                             TokenBitmask::Word* output,
+                                             std::size_t output_row_words) {
+    WalkScratch scratch;
+    for (std::size_t row = 0; row < batch_size; ++row) {
+        TokenEnforcer* enforcer = enforcers[row];
+        const OutputTensorState* state = enforcer->_get_state(token_ids + offsets[row], offsets[row + 1] - offsets[row], true, &scratch);
+        write_mask_row(*state->allowed_tokens_mask, output + row * output_row_words, output_row_words);
+    }
+}
+
+void TokenEnforcer::get_allowed_tokens_batch(const TokenEnforcerCursor* const* cursors,
+                                             std::size_t batch_size,
+                                             TokenBitmask::Word* output,
+                                             std::size_t output_row_words) {
+    for (std::size_t row = 0; row < batch_size; ++row) {
+        write_mask_row(cursors[row]->get_allowed_tokens_mask(), output + row * output_row_words, output_row_words);
+    }
+}
+
+std::size_t TokenEnforcer::verify_draft(FrozenTokenVector& prefix,
+                                        const int* draft_tokens,
+                                        std::size_t num_draft_tokens,
+                                        TokenBitmask::Word* output,
+                                        std::size_t output_row_words) {
+    const OutputTensorState* state = _get_state(prefix.data(), prefix.size());
+    OutputTensorStatePtr draft_state;
+    std::size_t num_accepted = 0;
+    write_mask_row(*state->allowed_tokens_mask, output, output_row_words);
+    // Holds prefix + the accepted draft so far, which is also the cache key of its state
+    lookup_key.assign(prefix.begin(), prefix.end());
+    while (num_accepted < num_draft_tokens && state->allowed_tokens_mask->test(draft_tokens[num_accepted])) {
+        lookup_key.push_back(draft_tokens[num_accepted]);
+        draft_state = _advance_state(state, draft_tokens[num_accepted], &lookup_key);
+        state = draft_state.get();
+        ++num_accepted;
+        write_mask_row(*state->allowed_tokens_mask, output + num_accepted * output_row_words, output_row_words);
+        // The model may accept fewer draft tokens than the grammar does, and continue from any of them.
+        // put() does not evict, so the prefix state stays valid until _evict_states() below
+        prefix_states.put(lookup_key, draft_state, _estimate_state_memory(lookup_key, state));
+    }
+    std::fill(output + (num_accepted + 1) * output_row_words, output + (num_draft_tokens + 1) * output_row_words, 0);
+    _evict_states();
+    return num_accepted;
+}
+
+void TokenEnforcer::_collect_allowed_tokens_parallel(CharacterLevelParserPtr parser, TokenBitmask& allowed_tree_tokens) {
+    struct WorkItem {
+        CharacterLevelParserPtr parser;
+        uint32_t tree_node;
+    };
+    const std::size_t concurrency = executor->concurrency();
+    const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+    auto subtree_size = [&tokenizer_tree](const WorkItem& item) {
+        return tokenizer_tree.nodes[item.tree_node].subtree_size;
+    };
+
+    // Takes the tokens of the node itself, and returns its children that the parser allows as new work items
+    auto expand = [&allowed_tree_tokens, &tokenizer_tree](const WorkItem& item, std::vector<WorkItem>& expanded) {
+        tokenizer_tree.add_node_tree_tokens(item.tree_node, allowed_tree_tokens);
+        const TokenizerPrefixTreeNode& node = tokenizer_tree.nodes[item.tree_node];
+        CharacterSet allowed_characters = item.parser->get_allowed_character_set();
+        for (uint32_t child = node.first_child; child < node.first_child + node.num_children; ++child) {
+            char character = tokenizer_tree.node_characters[child];
+            if (allowed_characters.contains(character)) {
+                expanded.push_back({item.parser->add_character(character), child});
+            }
+        }
+    };
+
+    std::vector<WorkItem> work_items;
+    expand({parser, TokenizerPrefixTree::ROOT}, work_items);
+    std::size_t total_tokens = 0;
+    for (const WorkItem& item : work_items) {
+        total_tokens += subtree_size(item);
+    }
+    if (concurrency <= 1 || total_tokens < min_parallel_tokens) {
+        for (const WorkItem& item : work_items) {
+            _collect_allowed_tokens(item.parser, item.tree_node, allowed_tree_tokens);
+        }
+        return;
+    }
+
+    // Subtrees that would dominate a single task are split one level further (a couple of times at most),
+    // so that a few huge root children (e.g. ' ') do not leave the other threads idle.
+    const std::size_t split_threshold = std::max<std::size_t>(1, total_tokens / (concurrency * 4));
+    for (int split_round = 0; split_round < 2; ++split_round) {
+        std::vector<WorkItem> split_items;
+        for (const WorkItem& item : work_items) {
+            if (subtree_size(item) > split_threshold && tokenizer_tree.nodes[item.tree_node].num_children != 0) {
+                expand(item, split_items);
+            } else {
+                split_items.push_back(item);
+            }
+        }
+        work_items.swap(split_items);
+    }
+
+    // Largest subtrees first, each into the least loaded task. Every task writes to its own bitmask.
+    std::sort(work_items.begin(), work_items.end(), [&subtree_size](const WorkItem& a, const WorkItem& b) {
+        return subtree_size(a) > subtree_size(b);
+    });
+    const std::size_t num_tasks = std::min(concurrency, work_items.size());
+    std::vector<std::vector<const WorkItem*>> task_items(num_tasks);
+    std::vector<std::size_t> task_loads(num_tasks, 0);
+    for (const WorkItem& item : work_items) {
+        std::size_t task_idx = std::min_element(task_loads.begin(), task_loads.end()) - task_loads.begin();
+        task_items[task_idx].push_back(&item);
+        task_loads[task_idx] += subtree_size(item);
+    }
+
+    std::vector<TokenBitmask> task_outputs(num_tasks, TokenBitmask(allowed_tree_tokens.size()));
+    std::vector<std::function<void()>> tasks;
+    for (std::size_t task_idx = 0; task_idx < num_tasks; ++task_idx) {
+        tasks.push_back([this, task_idx, &task_items, &task_outputs]() {
+            for (const WorkItem* item : task_items[task_idx]) {
+                _collect_allowed_tokens(item->parser, item->tree_node, task_outputs[task_idx]);
+            }
+        });
+    }
+    executor->run_all(tasks);
+    for (const TokenBitmask& task_output : task_outputs) {
+        task_output.or_into(allowed_tree_tokens.data());
+    }
+}
+
+void TokenEnforcer::verify_tree(FrozenTokenVector& prefix,
+                                const int* tree_tokens,
+                                const int* parent_indices,
+                                std::size_t num_nodes,
+                                bool* node_allowed,
+                                TokenBitmask::Word* output,
+                                std::size_t output_row_words) {
+    const OutputTensorState* prefix_state = _get_state(prefix.data(), prefix.size());
+    std::vector<OutputTensorStatePtr> node_states(num_nodes);
+    std::vector<int> path;
+    for (std::size_t node_idx = 0; node_idx < num_nodes; ++node_idx) {
+        int parent_idx = parent_indices[node_idx];
+        if (parent_idx >= static_cast<int>(node_idx)) {
+            throw LMFormatEnforcerException("verify_tree: every node must come after its parent");
+        }
+        const OutputTensorState* parent_state = parent_idx < 0 ? prefix_state : node_states[parent_idx].get();
+        TokenBitmask::Word* output_row = output + node_idx * output_row_words;
+        // A missing parent state means that the parent was disallowed, so the whole subtree is
+        if (parent_state == nullptr || !parent_state->allowed_tokens_mask->test(tree_tokens[node_idx])) {
+            node_allowed[node_idx] = false;
+            std::fill(output_row, output_row + output_row_words, 0);
+            continue;
+        }
+        path.clear();
+        for (int path_idx = static_cast<int>(node_idx); path_idx >= 0; path_idx = parent_indices[path_idx]) {
+            path.push_back(tree_tokens[path_idx]);
+        }
+        lookup_key.assign(prefix.begin(), prefix.end());
+        lookup_key.insert(lookup_key.end(), path.rbegin(), path.rend());
+        node_states[node_idx] = _advance_state(parent_state, tree_tokens[node_idx], &lookup_key);
+        node_allowed[node_idx] = true;
+        write_mask_row(*node_states[node_idx]->allowed_tokens_mask, output_row, output_row_words);
+        // put() does not evict, so prefix_state stays valid until _evict_states() below
+        prefix_states.put(lookup_key, node_states[node_idx], _estimate_state_memory(lookup_key, node_states[node_idx].get()));
+    }
+    _evict_states();
+}
+
+std::vector<int> TokenEnforcer::filter_allowed_candidates(FrozenTokenVector& token_sequence, const std::vector<int>& candidates, std::size_t max_allowed) {
+    OutputTensorState* state = _get_state(token_sequence.data(), token_sequence.size(), false);
+    if (!state->allowed_tokens_mask) {
+        // Another sequence (or enforcer) may already have computed the mask of an equivalent parser
+        std::size_t cache_key = state->parser->cache_key();
+        if (cache_key != 0) {
+            state->allowed_tokens_mask = tokenizer_data->allowed_token_cache.get(state->parser, cache_key);
+        }
+    }
+    std::vector<int> allowed_candidates;
+    for (int token_id : candidates) {
+        if (allowed_candidates.size() >= max_allowed) {
+            break;
+        }
+        bool is_allowed = state->allowed_tokens_mask ? state->allowed_tokens_mask->test(token_id) : _is_token_allowed(state->parser, token_id);
+        if (is_allowed) {
+            allowed_candidates.push_back(token_id);
+        }
+    }
+    if (allowed_candidates.empty() && !state->allowed_tokens_mask) {
+        _compute_allowed_tokens(&token_sequence, state);
+        _update_state_memory(token_sequence, state);
+    }
+    return allowed_candidates;
+}
+
+// Same result as looking the token up in the state's mask, by walking only this token's characters
+bool TokenEnforcer::_is_token_allowed(CharacterLevelParserPtr parser, int token_id) const {
+    if (token_id == tokenizer_data->eos_token_id) {
+        return parser->can_end();
+    }
+    const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+    if (!tokenizer_tree.is_regular_token(token_id)) {
+        return false;
+    }
+    std::string_view token_characters(tokenizer_tree.get_token_characters(token_id), tokenizer_tree.token_infos[token_id].string_length);
+    return parser->add_string(token_characters) != nullptr;
+}
+
+ForcedContinuation TokenEnforcer::_get_forced_continuation(CharacterLevelParserPtr parser, bool ignore_whitespace) const {
+    // Guards against parsers that force characters forever
+    const std::size_t max_forced_characters = 4096;
+    std::string forced_characters;
+    while (forced_characters.size() < max_forced_characters && !parser->can_end()) {
+        CharacterSet allowed_characters = parser->get_allowed_character_set();
+        if (ignore_whitespace) {
+            // The characters std::isspace() accepts
+            allowed_characters -= CharacterSet(" \t\n\v\f\r");
+        }
+        if (allowed_characters.size() != 1) {
+            break;
+        }
+        char forced_character = *allowed_characters.begin();
+        forced_characters += forced_character;
+        parser = parser->add_character(forced_character);
+    }
+
+    ForcedContinuation continuation;
+    std::size_t position = 0;
+    while (position < forced_characters.size()) {
+        const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+        uint32_t tree_node = TokenizerPrefixTree::ROOT;
+        std::size_t best_length = 0;
+        int best_token = -1;
+        for (std::size_t char_idx = position; char_idx < forced_characters.size(); ++char_idx) {
+            tree_node = tokenizer_tree.find_child(tree_node, forced_characters[char_idx]);
+            if (tree_node == TokenizerPrefixTree::NO_NODE) {
+                break;
+            }
+            const TokenizerPrefixTreeNode& node = tokenizer_tree.nodes[tree_node];
+            if (node.num_tokens != 0) {
+                best_length = char_idx - position + 1;
+                best_token = tokenizer_tree.token_pool[node.first_token];
+            }
+        }
+        if (best_token == -1) {
+            break;
+        }
+        continuation.token_ids.push_back(best_token);
+        position += best_length;
+    }
+    continuation.characters = forced_characters.substr(0, position);
+    return continuation;
+}
+
+void TokenEnforcerCursor::advance_async(int token_id) {
+    _wait_for_pending_state();
+    TokenEnforcer* enforcer = this->enforcer;
+    TokenEnforcer::OutputTensorStatePtr current_state = state;
+    if (!enforcer->executor) {
+        pending_state = std::async(std::launch::async, [enforcer, current_state, token_id]() {
+            return enforcer->_advance_state(current_state.get(), token_id, nullptr);
+        }).share();
+        return;
+    }
+    std::shared_ptr<std::promise<TokenEnforcer::OutputTensorStatePtr>> next_state =
+        std::make_shared<std::promise<TokenEnforcer::OutputTensorStatePtr>>();
+    pending_state = next_state->get_future().share();
+    enforcer->executor->submit([enforcer, current_state, token_id, next_state]() {
+        try {
+            next_state->set_value(enforcer->_advance_state(current_state.get(), token_id, nullptr));
+        } catch (...) {
+            next_state->set_exception(std::current_exception());
+        }
+    });
+}
@@ -1,37 +1,403 @@
 #include "lmfe/tokenizerdata.hpp"
+#include "lmfe/exceptions.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 
-TokenizerPrefixTree::TokenizerPrefixTree(std::vector<std::tuple<int, std::string, bool>> regular_tokens) {
-    root = new TokenizerPrefixTreeNode();
+const uint32_t TokenizerPrefixTree::ROOT;
+const uint32_t TokenizerPrefixTree::NO_NODE;
+const uint16_t CharacterClassTokenIndex::SATURATED;
+
+TokenizerPrefixTree::TokenizerPrefixTree(const std::vector<std::tuple<int, std::string, bool>>& regular_tokens) {
+    // Built with per node maps first, then flattened in BFS order
+    struct BuildNode {
+        std::map<unsigned char, uint32_t> children;
+        std::vector<int> tokens;
+        uint32_t subtree_size = 0;
+    };
+    std::vector<BuildNode> build_nodes(1);
+    // The build node each token ends at, until the final node indices are known
+    std::vector<uint32_t> token_build_nodes;
     for (const auto& token : regular_tokens) {
         int token_idx;
         std::string decoded;
         bool is_new_word;
         std::tie(token_idx, decoded, is_new_word) = token;
-        tokens_to_strs[token_idx] = decoded;
-        _add_token_to_tree(decoded, token_idx, root);
-        if (is_new_word) {
-            new_word_tokens.insert(token_idx);
+        if (static_cast<std::size_t>(token_idx) >= owned_token_infos.size()) {
+            owned_token_infos.resize(token_idx + 1, TokenInfo());
+            token_build_nodes.resize(token_idx + 1, ROOT);
+        }
+        owned_token_infos[token_idx] = _make_token_info(decoded, is_new_word, static_cast<uint32_t>(owned_token_string_blob.size()));
+        owned_token_string_blob.insert(owned_token_string_blob.end(), decoded.begin(), decoded.end());
+        uint32_t node_idx = ROOT;
+        for (char character : decoded) {
+            build_nodes[node_idx].subtree_size++;
+            auto child_it = build_nodes[node_idx].children.find(static_cast<unsigned char>(character));
+            if (child_it == build_nodes[node_idx].children.end()) {
+                uint32_t child_idx = static_cast<uint32_t>(build_nodes.size());
+                build_nodes[node_idx].children[static_cast<unsigned char>(character)] = child_idx;
+                build_nodes.emplace_back();
+                node_idx = child_idx;
+            } else {
+                node_idx = child_it->second;
+            }
+        }
+        build_nodes[node_idx].subtree_size++;
+        build_nodes[node_idx].tokens.push_back(token_idx);
+        token_build_nodes[token_idx] = node_idx;
+    }
+
+    std::vector<uint32_t> bfs_order(1, ROOT);
+    bfs_order.reserve(build_nodes.size());
+    for (std::size_t position = 0; position < bfs_order.size(); ++position) {
+        for (const auto& child : build_nodes[bfs_order[position]].children) {
+            bfs_order.push_back(child.second);
+        }
+    }
+    std::vector<uint32_t> build_node_positions(build_nodes.size());
+    for (std::size_t position = 0; position < bfs_order.size(); ++position) {
+        build_node_positions[bfs_order[position]] = static_cast<uint32_t>(position);
+    }
+    for (std::size_t token_idx = 0; token_idx < owned_token_infos.size(); ++token_idx) {
+        owned_token_infos[token_idx].tree_node = build_node_positions[token_build_nodes[token_idx]];
+    }
+    owned_nodes.resize(build_nodes.size());
+    owned_node_characters.resize(build_nodes.size(), '\0');
+    // The children of the node at each position start right after the children of every earlier node
+    uint32_t next_child = 1;
+    for (std::size_t position = 0; position < bfs_order.size(); ++position) {
+        const BuildNode& build_node = build_nodes[bfs_order[position]];
+        TokenizerPrefixTreeNode& node = owned_nodes[position];
+        node.first_child = next_child;
+        node.num_children = static_cast<uint32_t>(build_node.children.size());
+        node.num_tokens = static_cast<uint32_t>(build_node.tokens.size());
+        node.subtree_size = build_node.subtree_size;
+        for (const auto& child : build_node.children) {
+            owned_node_characters[next_child++] = static_cast<char>(child.first);
         }
     }
+
+    // The token pool is filled in DFS order, so that every subtree is one range of it
+    owned_token_pool.reserve(regular_tokens.size());
+    std::vector<uint32_t> dfs_stack(1, ROOT);
+    while (!dfs_stack.empty()) {
+        uint32_t build_node_idx = dfs_stack.back();
+        dfs_stack.pop_back();
+        const BuildNode& build_node = build_nodes[build_node_idx];
+        owned_nodes[build_node_positions[build_node_idx]].first_token = static_cast<uint32_t>(owned_token_pool.size());
+        owned_token_pool.insert(owned_token_pool.end(), build_node.tokens.begin(), build_node.tokens.end());
+        for (auto child_it = build_node.children.rbegin(); child_it != build_node.children.rend(); ++child_it) {
+            dfs_stack.push_back(child_it->second);
+        }
+    }
+
+    nodes = owned_nodes;
+    node_characters = owned_node_characters;
+    token_pool = owned_token_pool;
+    token_infos = owned_token_infos;
+    token_string_blob = owned_token_string_blob;
 }
 
-void TokenizerPrefixTree::_add_token_to_tree(const std::string& token_str, int token_idx, TokenizerPrefixTreeNode* node) {
+TokenInfo TokenizerPrefixTree::_make_token_info(const std::string& token_str, bool is_new_word, uint32_t string_offset) {
+    TokenInfo info;
+    info.string_offset = string_offset;
+    info.string_length = static_cast<uint32_t>(token_str.size());
+    info.first_character = token_str.empty() ? '\0' : token_str[0];
+    info.flags = TokenInfo::REGULAR | (is_new_word ? TokenInfo::NEW_WORD : 0);
+    bool is_digits_only = !token_str.empty();
+    bool is_whitespace_only = !token_str.empty();
     for (char character : token_str) {
-        if (node->children.find(character) == node->children.end()) {
-            node->children[character] = new TokenizerPrefixTreeNode();
+        is_digits_only = is_digits_only && character >= '0' && character <= '9';
+        is_whitespace_only = is_whitespace_only && (character == ' ' || character == '\t' || character == '\n' || character == '\r');
+        if (character == '"') {
+            info.flags |= TokenInfo::CONTAINS_QUOTE;
+        } else if (character == '\\') {
+            info.flags |= TokenInfo::CONTAINS_BACKSLASH;
         }
-        node = node->children[character];
     }
-    node->tokens.push_back(token_idx);
+    info.flags |= (is_digits_only ? TokenInfo::DIGITS_ONLY : 0) | (is_whitespace_only ? TokenInfo::WHITESPACE_ONLY : 0);
+    return info;
+}
+
+TokenizerPrefixTree::TokenizerPrefixTree(ConstArrayView<TokenizerPrefixTreeNode> nodes,
+                                         ConstArrayView<char> node_characters,
+                                         ConstArrayView<int> token_pool,
+                                         ConstArrayView<TokenInfo> token_infos,
+                                         ConstArrayView<char> token_string_blob,
+                                         std::shared_ptr<const MappedFile> storage)
+    : nodes(nodes), node_characters(node_characters), token_pool(token_pool), token_infos(token_infos),
+      token_string_blob(token_string_blob), storage(storage) {
 }
 
 void TokenEnforcerTokenizerData::initialize()
 {
     regular_tokens = get_regular_tokens();
     eos_token_id = get_eos_token_id();
-    
+    vocab_size = eos_token_id + 1;
+    for (const auto& token : regular_tokens) {
+        vocab_size = std::max(vocab_size, std::get<0>(token) + 1);
+    }
+
+    delete tokenizer_tree;
     tokenizer_tree = new TokenizerPrefixTree(regular_tokens);
-    for (const auto& token_str : tokenizer_tree->root->children) {
-        tokenizer_alphabet += token_str.first;
+    _initialize_alphabet();
+}
+
+void TokenEnforcerTokenizerData::_initialize_alphabet() {
+    const TokenizerPrefixTreeNode& root = tokenizer_tree->nodes[TokenizerPrefixTree::ROOT];
+    tokenizer_alphabet.assign(tokenizer_tree->node_characters.begin() + root.first_child,
+                              tokenizer_tree->node_characters.begin() + root.first_child + root.num_children);
+}
+
+TokenEnforcerTokenizerData::~TokenEnforcerTokenizerData() {
+    delete tokenizer_tree;
+}
+
+uint64_t TokenEnforcerTokenizerData::get_vocabulary_checksum() const {
+    uint64_t checksum = checksum64(nullptr, 0, static_cast<uint64_t>(get_eos_token_id()));
+    for (const auto& token : get_regular_tokens()) {
+        int token_id = std::get<0>(token);
+        const std::string& token_str = std::get<1>(token);
+        uint8_t is_new_word = std::get<2>(token) ? 1 : 0;
+        checksum = checksum64(&token_id, sizeof(token_id), checksum);
+        checksum = checksum64(token_str.data(), token_str.size(), checksum);
+        checksum = checksum64(&is_new_word, sizeof(is_new_word), checksum);
+    }
+    return checksum;
+}
+
+// Tokenizer file layout: the header, followed by one section per array of TokenizerPrefixTree, each starting at a
+// multiple of TOKENIZER_FILE_ALIGNMENT so that the arrays can be used in place. All values are in native byte order,
+// a file written on a machine with another byte order is rejected through byte_order_mark.
+namespace {
+    const char TOKENIZER_FILE_MAGIC[8] = {'L', 'M', 'F', 'E', 'T', 'O', 'K', '\0'};
+    const uint32_t TOKENIZER_FILE_VERSION = 2;
+    const uint32_t TOKENIZER_FILE_BYTE_ORDER_MARK = 0x01020304;
+    const std::size_t TOKENIZER_FILE_ALIGNMENT = 16;
+
+    struct TokenizerFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byte_order_mark;
+        uint64_t vocabulary_checksum;
+        // Of everything after the header
+        uint64_t data_checksum;
+        int32_t eos_token_id;
+        int32_t vocab_size;
+        uint64_t num_nodes;
+        uint64_t num_pool_tokens;
+        uint64_t num_token_ids;
+        uint64_t num_token_string_bytes;
+    };
+
+    struct TokenizerFileSection {
+        const void* data;
+        std::size_t size;
+    };
+
+    std::size_t align_offset(std::size_t offset) {
+        return (offset + TOKENIZER_FILE_ALIGNMENT - 1) / TOKENIZER_FILE_ALIGNMENT * TOKENIZER_FILE_ALIGNMENT;
     }
-}
\ No newline at end of file
+
+    // Offsets of each section from the start of the file, and the total file size as the last entry
+    std::vector<std::size_t> get_section_offsets(const std::vector<std::size_t>& section_sizes) {
+        std::vector<std::size_t> offsets;
+        std::size_t offset = sizeof(TokenizerFileHeader);
+        for (std::size_t size : section_sizes) {
+            offset = align_offset(offset);
+            offsets.push_back(offset);
+            offset += size;
+        }
+        offsets.push_back(offset);
+        return offsets;
+    }
+
+    std::vector<std::size_t> get_section_sizes(const TokenizerFileHeader& header) {
+        return {
+            header.num_nodes * sizeof(TokenizerPrefixTreeNode),
+            header.num_nodes * sizeof(char),
+            header.num_pool_tokens * sizeof(int),
+            header.num_token_ids * sizeof(TokenInfo),
+            header.num_token_string_bytes,
+        };
+    }
+}
+
+void TokenEnforcerTokenizerData::save_to_file(const std::string& path) {
+    const TokenizerPrefixTree& tree = *tokenizer_tree;
+    TokenizerFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, TOKENIZER_FILE_MAGIC, sizeof(header.magic));
+    header.version = TOKENIZER_FILE_VERSION;
+    header.byte_order_mark = TOKENIZER_FILE_BYTE_ORDER_MARK;
+    header.vocabulary_checksum = get_vocabulary_checksum();
+    header.eos_token_id = eos_token_id;
+    header.vocab_size = vocab_size;
+    header.num_nodes = tree.nodes.size();
+    header.num_pool_tokens = tree.token_pool.size();
+    header.num_token_ids = tree.token_infos.size();
+    header.num_token_string_bytes = tree.token_string_blob.size();
+
+    const TokenizerFileSection sections[] = {
+        {tree.nodes.data(), tree.nodes.size() * sizeof(TokenizerPrefixTreeNode)},
+        {tree.node_characters.data(), tree.node_characters.size() * sizeof(char)},
+        {tree.token_pool.data(), tree.token_pool.size() * sizeof(int)},
+        {tree.token_infos.data(), tree.token_infos.size() * sizeof(TokenInfo)},
+        {tree.token_string_blob.data(), tree.token_string_blob.size()},
+    };
+    std::vector<std::size_t> offsets = get_section_offsets(get_section_sizes(header));
+    std::vector<char> data(offsets.back() - sizeof(TokenizerFileHeader), 0);
+    for (std::size_t section_idx = 0; section_idx < sizeof(sections) / sizeof(sections[0]); ++section_idx) {
+        if (sections[section_idx].size > 0) {
+            std::memcpy(data.data() + offsets[section_idx] - sizeof(TokenizerFileHeader), sections[section_idx].data, sections[section_idx].size);
+        }
+    }
+    header.data_checksum = checksum64(data.data(), data.size());
+
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(data.data(), data.size());
+    stream.close();
+    if (!stream) {
+        throw LMFormatEnforcerException("Could not write the tokenizer file " + path);
+    }
+}
+
+bool TokenEnforcerTokenizerData::initialize_from_file(const std::string& path) {
+    std::shared_ptr<const MappedFile> file;
+    try {
+        file = std::make_shared<MappedFile>(path);
+    } catch (const LMFormatEnforcerException&) {
+        return false;
+    }
+    if (file->size() < sizeof(TokenizerFileHeader)) {
+        return false;
+    }
+    TokenizerFileHeader header;
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, TOKENIZER_FILE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != TOKENIZER_FILE_VERSION ||
+        header.byte_order_mark != TOKENIZER_FILE_BYTE_ORDER_MARK ||
+        header.num_nodes == 0) {
+        return false;
+    }
+    std::vector<std::size_t> offsets = get_section_offsets(get_section_sizes(header));
+    if (offsets.back() != file->size() ||
+        checksum64(file->data() + sizeof(header), file->size() - sizeof(header)) != header.data_checksum ||
+        header.vocabulary_checksum != get_vocabulary_checksum()) {
+        return false;
+    }
+
+    // Replaces a tree from an earlier initialize() call, whose regular_tokens no longer describe the mapped tree
+    delete tokenizer_tree;
+    regular_tokens.clear();
+    const char* data = file->data();
+    tokenizer_tree = new TokenizerPrefixTree(
+        ConstArrayView<TokenizerPrefixTreeNode>(reinterpret_cast<const TokenizerPrefixTreeNode*>(data + offsets[0]), header.num_nodes),
+        ConstArrayView<char>(data + offsets[1], header.num_nodes),
+        ConstArrayView<int>(reinterpret_cast<const int*>(data + offsets[2]), header.num_pool_tokens),
+        ConstArrayView<TokenInfo>(reinterpret_cast<const TokenInfo*>(data + offsets[3]), header.num_token_ids),
+        ConstArrayView<char>(data + offsets[4], header.num_token_string_bytes),
+        file);
+    eos_token_id = header.eos_token_id;
+    vocab_size = header.vocab_size;
+    _initialize_alphabet();
+    return true;
+}
+CharacterClassTokenIndex::CharacterClassTokenIndex(const TokenizerPrefixTree& tokenizer_tree,
+                                                   const std::string& class_characters,
+                                                   const std::string& run_limited_characters,
+                                                   std::size_t max_run) : max_run(max_run) {
+    std::fill(this->class_characters, this->class_characters + 256, false);
+    nodes_leading_outside_class.resize(tokenizer_tree.nodes.size(), false);
+    for (char character : class_characters) {
+        this->class_characters[static_cast<unsigned char>(character)] = true;
+    }
+    bool is_run_limited[256] = {};
+    for (char character : run_limited_characters) {
+        is_run_limited[static_cast<unsigned char>(character)] = true;
+    }
+
+    // Children come after their parents in BFS order, so a reverse pass sees every child before its parent
+    const std::size_t num_nodes = tokenizer_tree.nodes.size();
+    subtree_in_class.assign(num_nodes, true);
+    subtree_max_run.assign(num_nodes, 0);
+    subtree_depth.assign(num_nodes, 0);
+    // The longest run of run limited characters that starts right below each node
+    std::vector<uint16_t> leading_run(num_nodes, 0);
+    for (std::size_t node_idx = num_nodes; node_idx-- > 0;) {
+        const TokenizerPrefixTreeNode& node = tokenizer_tree.nodes[node_idx];
+        for (uint32_t child = node.first_child; child < node.first_child + node.num_children; ++child) {
+            unsigned char character = static_cast<unsigned char>(tokenizer_tree.node_characters[child]);
+            if (!this->class_characters[character] || !subtree_in_class[child]) {
+                subtree_in_class[node_idx] = false;
+                break;
+            }
+            uint16_t run = is_run_limited[character] ? std::min<uint16_t>(leading_run[child] + 1, SATURATED) : 0;
+            leading_run[node_idx] = std::max(leading_run[node_idx], run);
+            subtree_max_run[node_idx] = std::max({subtree_max_run[node_idx], subtree_max_run[child], run});
+            subtree_depth[node_idx] = std::max(subtree_depth[node_idx], std::min<uint16_t>(subtree_depth[child] + 1, SATURATED));
+        }
+    }
+    const int num_token_bits = static_cast<int>(tokenizer_tree.token_infos.size());
+
+    std::vector<std::vector<int>> tokens_by_length;
+    for (int token_id = 0; token_id < num_token_bits; ++token_id) {
+        const TokenInfo& info = tokenizer_tree.token_infos[token_id];
+        if (!(info.flags & TokenInfo::REGULAR) || info.string_length == 0) {
+            continue;
+        }
+        const char* token_str = tokenizer_tree.get_token_characters(token_id);
+        const std::size_t token_length = info.string_length;
+        std::size_t run_length = 0;
+        bool exceeds_run = false;
+        std::size_t char_idx = 0;
+        for (; char_idx < token_length && is_class_character(token_str[char_idx]); ++char_idx) {
+            run_length = run_limited_characters.find(token_str[char_idx]) != std::string::npos ? run_length + 1 : 0;
+            exceeds_run = exceeds_run || run_length > max_run;
+        }
+        if (char_idx < token_length) {
+            // Mark the path up to the node where the token leaves the class
+            uint32_t node = TokenizerPrefixTree::ROOT;
+            nodes_leading_outside_class[node] = true;
+            for (std::size_t path_idx = 0; path_idx < char_idx; ++path_idx) {
+                node = tokenizer_tree.find_child(node, token_str[path_idx]);
+                nodes_leading_outside_class[node] = true;
+            }
+            continue;
+        }
+        if (exceeds_run) {
+            continue;
+        }
+        if (token_length >= tokens_by_length.size()) {
+            tokens_by_length.resize(token_length + 1);
+        }
+        tokens_by_length[token_length].push_back(token_id);
+    }
+
+    tokens_up_to_length.reserve(std::max<std::size_t>(tokens_by_length.size(), 1));
+    tokens_up_to_length.emplace_back(num_token_bits);
+    for (std::size_t length = 1; length < tokens_by_length.size(); ++length) {
+        TokenBitmask bitmask = tokens_up_to_length.back();
+        for (int token_id : tokens_by_length[length]) {
+            bitmask.set(token_id);
+        }
+        tokens_up_to_length.push_back(std::move(bitmask));
+    }
+}
+
+void CharacterClassTokenIndex::collect_tokens_up_to_length(std::size_t max_length, TokenBitmask& allowed_tokens) const {
+    const TokenBitmask& tokens = tokens_up_to_length[std::min(max_length, get_max_token_length())];
+    tokens.or_into(allowed_tokens.data());
+}
+
+const CharacterClassTokenIndex& TokenizerPrefixTree::get_character_class_index(const std::string& class_characters,
+                                                                               const std::string& run_limited_characters,
+                                                                               std::size_t max_run) {
+    std::lock_guard<std::mutex> lock(character_class_indices_mutex);
+    std::unique_ptr<CharacterClassTokenIndex>& index = character_class_indices[std::make_tuple(class_characters, run_limited_characters, max_run)];
+    if (!index) {
+        index.reset(new CharacterClassTokenIndex(*this, class_characters, run_limited_characters, max_run));
+    }
+    return *index;
+}
@@ -321,4 +321,97 @@ TEST_CASE("test_union", "[json]")
     test_json_schema_parsing_with_string(R"(
         {"key": false}
     )", schema, false);
-}
\ No newline at end of file
+}
+TEST_CASE("test_recursive_schema", "[json]")
+{
+    std::string schema = R"(
+        {"$defs": {"TreeNode": {"properties": {"value": {"type": "integer"}, "children": {"items": {"$ref": "#/$defs/TreeNode"}, "type": "array"}}, "required": ["value"], "title": "TreeNode", "type": "object"}}, "$ref": "#/$defs/TreeNode"}
+    )";
+    test_json_schema_parsing_with_string(R"(
+        {"value": 1}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"value": 1, "children": [{"value": 2, "children": [{"value": 3}]}, {"value": 4, "children": []}]}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"value": 1, "children": [{"value": 2, "children": [{"name": 3}]}]}
+    )", schema, false);
+    test_json_schema_parsing_with_string(R"(
+        {"value": 1, "children": [{"children": []}]}
+    )", schema, false);
+}
+
+TEST_CASE("test_object_with_many_properties", "[json]")
+{
+    // Keys past the 64th are tracked in the second word of the object's key bitmasks
+    json schema_json = {{"type", "object"}, {"properties", json::object()}, {"required", {"key_1", "key_65", "key_69"}}};
+    for (int key_idx = 0; key_idx < 70; ++key_idx) {
+        schema_json["properties"]["key_" + std::to_string(key_idx)] = {{"type", "integer"}};
+    }
+    std::string schema = schema_json.dump();
+    test_json_schema_parsing_with_string(R"(
+        {"key_69": 1, "key_1": 2, "key_65": 3}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"key_1": 1, "key_64": 2, "key_65": 3, "key_66": 4, "key_69": 5}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"key_1": 1, "key_65": 2}
+    )", schema, false);
+    test_json_schema_parsing_with_string(R"(
+        {"key_1": 1, "key_65": 2, "key_69": 3, "key_65": 4}
+    )", schema, false);
+    test_json_schema_parsing_with_string(R"(
+        {"key_1": 1, "key_65": 2, "key_69": 3, "key_70": 4}
+    )", schema, false);
+}
+
+TEST_CASE("test_enum_values_that_are_prefixes", "[json]")
+{
+    std::string schema = R"(
+        {"properties": {"key": {"enum": ["ab", "abc"], "title": "Key", "type": "string"}}, "required": ["key"], "title": "SchemaWithEnum", "type": "object"}
+    )";
+    test_json_schema_parsing_with_string(R"(
+        {"key": "ab"}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"key": "abc"}
+    )", schema, true);
+    test_json_schema_parsing_with_string(R"(
+        {"key": "a"}
+    )", schema, false);
+    test_json_schema_parsing_with_string(R"(
+        {"key": "abcd"}
+    )", schema, false);
+}
+
+TEST_CASE("test_parser_stack_sharing", "[json]")
+{
+    std::string schema = R"(
+        {"items": {"items": {"type": "integer"}, "type": "array"}, "type": "array"}
+    )";
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(schema, nullptr);
+    for (char character : std::string("[[1")) {
+        parser = parser->add_character(character);
+    }
+    const ParserStack& stack = static_cast<JsonSchemaParser*>(parser.get())->object_stack;
+
+    // Sibling states only replace the frames they change, and share the rest with their parent state
+    CharacterLevelParserPtr next_digit = parser->add_character('2');
+    CharacterLevelParserPtr list_end = parser->add_character(']');
+    ParserStack next_digit_stack = static_cast<JsonSchemaParser*>(next_digit.get())->object_stack;
+    ParserStack list_end_stack = static_cast<JsonSchemaParser*>(list_end.get())->object_stack;
+    REQUIRE(next_digit_stack.size() == stack.size());
+    REQUIRE(list_end_stack.size() == stack.size() - 1);
+    ParserStack below_number = stack;
+    below_number.pop();
+    next_digit_stack.pop();
+    REQUIRE(next_digit_stack.shares_frames_with(below_number));
+    below_number.pop();
+    list_end_stack.pop();
+    REQUIRE(list_end_stack.shares_frames_with(below_number));
+
+    // A character that no parser on the stack accepts is an error, not a read past the bottom of the stack
+    REQUIRE_FALSE(parser->get_allowed_character_set().contains('x'));
+    REQUIRE_THROWS_WITH(parser->add_character('x'), Catch::Matchers::Contains("is not allowed"));
+}
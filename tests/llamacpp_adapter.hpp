@@ -1,4 +1,5 @@
 #include <llama.h>
+#include <cstring>
 #include <lmfe/tokenizerdata.hpp>
 
 class LlamaCppTokenizerData : public TokenEnforcerTokenizerData {
@@ -31,6 +32,19 @@ protected:
     virtual int get_eos_token_id() const {
         return llama_token_eos(model);
     };
+    // Hashes the raw vocabulary that llama.cpp keeps in memory, so that loading a tokenizer file does not decode anything
+    virtual uint64_t get_vocabulary_checksum() const {
+        auto vocab_size = llama_n_vocab(model);
+        uint64_t checksum = checksum64(nullptr, 0, static_cast<uint64_t>(llama_token_eos(model)));
+        for (int i = 0; i < vocab_size; ++i)
+        {
+            int token_type = llama_token_get_type(model, i);
+            const char* token_text = llama_token_get_text(model, i);
+            checksum = checksum64(&token_type, sizeof(token_type), checksum);
+            checksum = checksum64(token_text, strlen(token_text), checksum);
+        }
+        return checksum;
+    };
 
     // Taken from llamacpp/common/common.cpp llama_token_to_piece
 
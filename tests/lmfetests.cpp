@@ -1,6 +1,7 @@
 #define CATCH_CONFIG_MAIN
 #include <catch2/catch.hpp>
 #include <lmfe/lmfe.hpp>
+#include <numeric>
 
 TEST_CASE( "Basic String Parser Check", "[main]" ) {
     auto parser = CharacterLevelParserPtr(new StringParser("abc"));
@@ -21,3 +22,110 @@ TEST_CASE( "Basic String Parser Check2", "[main]" ) {
     parser = parser->add_character('b');
     REQUIRE( parser->get_allowed_characters() == "c" );
 }
+
+TEST_CASE( "Token Bitmask Check", "[main]" ) {
+    TokenBitmask bitmask(70);
+    REQUIRE( bitmask.word_count() == 3 );
+    REQUIRE( bitmask.none() );
+    bitmask.set(0);
+    bitmask.set(33);
+    bitmask.set(69);
+    REQUIRE( bitmask.count() == 3 );
+    REQUIRE( bitmask.test(33) );
+    REQUIRE( !bitmask.test(34) );
+    REQUIRE( bitmask.to_token_list() == std::vector<int>({0, 33, 69}) );
+    std::vector<TokenBitmask::Word> words(bitmask.word_count(), 0);
+    words[0] = 2;
+    bitmask.or_into(words.data());
+    REQUIRE( words[0] == 3 );
+    REQUIRE( words[1] == 2 );
+    REQUIRE( words[2] == 32 );
+
+    // Ranges within a word, across words, and ending on a word boundary
+    const std::size_t ranges[][2] = {{3, 7}, {30, 70}, {0, 64}, {5, 5}};
+    for (const auto& range : ranges) {
+        TokenBitmask range_bitmask(70);
+        range_bitmask.set_range(range[0], range[1]);
+        std::vector<int> expected(range[1] - range[0]);
+        std::iota(expected.begin(), expected.end(), static_cast<int>(range[0]));
+        REQUIRE( range_bitmask.to_token_list() == expected );
+    }
+}
+
+CharacterLevelParserPtr add_string_for_cache_test(CharacterLevelParserPtr parser, const std::string& string) {
+    for (char character : string) {
+        parser = parser->add_character(character);
+    }
+    return parser;
+}
+
+TEST_CASE( "Character Set Check", "[main]" ) {
+    CharacterSet characters("cab\x80");
+    REQUIRE( characters.size() == 4 );
+    REQUIRE( characters.contains('a') );
+    REQUIRE( characters.contains('\x80') );
+    REQUIRE( !characters.contains('d') );
+    REQUIRE( characters.to_string() == "abc\x80" );
+    REQUIRE( (characters | CharacterSet("cd")).to_string() == "abcd\x80" );
+    REQUIRE( (characters & CharacterSet("cd")).to_string() == "c" );
+    REQUIRE( (characters - CharacterSet("a\x80")).to_string() == "bc" );
+    REQUIRE( characters.contains_all(CharacterSet("ab")) );
+    REQUIRE( !characters.contains_all(CharacterSet("ad")) );
+    REQUIRE( CharacterSet().empty() );
+    REQUIRE( CharacterSet().add('\xff').remove('\xff').empty() );
+
+    // Parsers that only implement one of the two accessors get the other one for free
+    auto union_parser = CharacterLevelParserPtr(new UnionParser({CharacterLevelParserPtr(new StringParser("b")),
+                                                                 CharacterLevelParserPtr(new StringParser("a"))}));
+    REQUIRE( union_parser->get_allowed_character_set() == CharacterSet("ab") );
+    REQUIRE( union_parser->get_allowed_characters() == "ab" );
+}
+
+bool have_same_cache_key(CharacterLevelParserPtr parser, CharacterLevelParserPtr other_parser) {
+    return parser->cache_key() != 0 && parser->cache_key() == other_parser->cache_key() && parser->cache_equals(*other_parser);
+}
+
+TEST_CASE( "Parser Cache Key Check", "[main]" ) {
+    REQUIRE( have_same_cache_key(CharacterLevelParserPtr(new StringParser("abc")), CharacterLevelParserPtr(new StringParser("abc"))) );
+    REQUIRE( !have_same_cache_key(CharacterLevelParserPtr(new StringParser("abc")), CharacterLevelParserPtr(new StringParser("abd"))) );
+
+    CharacterLevelParserPtr list_parser = std::make_shared<JsonSchemaParser>(R"({"type": "array", "items": {"type": "integer"}})", nullptr);
+    REQUIRE( have_same_cache_key(add_string_for_cache_test(list_parser, "[1, "), add_string_for_cache_test(list_parser, "[23, ")) );
+    REQUIRE( have_same_cache_key(add_string_for_cache_test(list_parser, "[1, 2"), add_string_for_cache_test(list_parser, "[23, 45")) );
+    REQUIRE( !have_same_cache_key(add_string_for_cache_test(list_parser, "[1,"), add_string_for_cache_test(list_parser, "[1, ")) );
+    REQUIRE( !have_same_cache_key(add_string_for_cache_test(list_parser, "[1"), add_string_for_cache_test(list_parser, "[1,")) );
+
+    CharacterLevelParserPtr string_parser = std::make_shared<JsonSchemaParser>(R"({"type": "string"})", nullptr);
+    REQUIRE( have_same_cache_key(add_string_for_cache_test(string_parser, "\"hello"), add_string_for_cache_test(string_parser, "\"hi")) );
+    REQUIRE( !have_same_cache_key(add_string_for_cache_test(string_parser, "\""), add_string_for_cache_test(string_parser, "\"hi")) );
+
+    CharacterLevelParserPtr limited_string_parser = std::make_shared<JsonSchemaParser>(R"({"type": "string", "maxLength": 3})", nullptr);
+    REQUIRE( !have_same_cache_key(add_string_for_cache_test(limited_string_parser, "\"ab"), add_string_for_cache_test(limited_string_parser, "\"abc")) );
+
+    // Object keys are told apart by their text, not only by their length like free text values
+    CharacterLevelParserPtr dict_parser = std::make_shared<JsonSchemaParser>(R"({"type": "object", "additionalProperties": {"type": "integer"}})", nullptr);
+    REQUIRE( !have_same_cache_key(add_string_for_cache_test(dict_parser, "{\"nu"), add_string_for_cache_test(dict_parser, "{\"xy")) );
+    REQUIRE( have_same_cache_key(add_string_for_cache_test(dict_parser, "{\"nu"), add_string_for_cache_test(dict_parser, "{ \"nu")) );
+}
+
+TEST_CASE( "Schema Registry Check", "[main]" ) {
+    JsonSchemaRegistry registry(1);
+    auto context = registry.get_context(R"({"type": "array", "items": {"type": "integer"}})");
+    REQUIRE( registry.get_context(R"({"type": "array", "items": {"type": "integer"}})") == context );
+    // Same schema, reformatted and with its keys in another order
+    REQUIRE( registry.get_context(R"({"items":{"type":"integer"},"type":"array"})") == context );
+    REQUIRE( registry.get_context(R"({"type": "string"})") != context );
+
+    // Over budget, but contexts are only dropped once no parser holds them
+    REQUIRE( registry.size() == 2 );
+    REQUIRE( registry.get_context(R"({"type": "array", "items": {"type": "integer"}})") == context );
+    context.reset();
+    auto number_context = registry.get_context(R"({"type": "number"})");
+    REQUIRE( registry.size() == 1 );
+    REQUIRE( registry.get_context(R"({"type": "number"})") == number_context );
+
+    // Parsers of the same schema share its context, so their states share allowed token cache entries
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(R"({"type": "array", "items": {"type": "integer"}})", nullptr);
+    CharacterLevelParserPtr other_parser = std::make_shared<JsonSchemaParser>(R"({"type": "array", "items": {"type": "integer"}})", nullptr);
+    REQUIRE( have_same_cache_key(add_string_for_cache_test(parser, "[1, "), add_string_for_cache_test(other_parser, "[2, ")) );
+}
@@ -0,0 +1,100 @@
+#include <catch2/catch.hpp>
+#include <cmath>
+#include <vector>
+#include <lmfe/logitsmasking.hpp>
+
+const LogitsMaskingImplementation ALL_IMPLEMENTATIONS[] = {
+    LogitsMaskingImplementation::SCALAR,
+    LogitsMaskingImplementation::AVX2,
+    LogitsMaskingImplementation::AVX512
+};
+
+TokenBitmask make_test_bitmask(std::size_t num_bits) {
+    TokenBitmask bitmask(num_bits);
+    for (std::size_t token_id = 0; token_id < num_bits; ++token_id) {
+        // A mix of fully allowed, fully disallowed and partial words
+        std::size_t word_idx = token_id / TokenBitmask::BITS_PER_WORD;
+        if (word_idx % 3 == 0 || (word_idx % 3 == 1 && token_id % 7 == 0)) {
+            bitmask.set(token_id);
+        }
+    }
+    return bitmask;
+}
+
+TEST_CASE("test_float_logits_masking", "[logitsmasking]")
+{
+    // Logits row is longer than the bitmask, like a padded model vocabulary
+    const std::size_t num_bits = 1000;
+    const std::size_t num_logits = 1030;
+    TokenBitmask bitmask = make_test_bitmask(num_bits);
+    for (LogitsMaskingImplementation implementation : ALL_IMPLEMENTATIONS) {
+        select_logits_masking_implementation(implementation);
+        std::vector<float> logits(num_logits);
+        for (std::size_t i = 0; i < num_logits; ++i) {
+            logits[i] = static_cast<float>(i);
+        }
+        apply_token_bitmask_inplace(logits.data(), logits.size(), bitmask);
+        for (std::size_t i = 0; i < num_logits; ++i) {
+            if (bitmask.test(i)) {
+                REQUIRE(logits[i] == static_cast<float>(i));
+            } else {
+                REQUIRE(std::isinf(logits[i]));
+                REQUIRE(logits[i] < 0);
+            }
+        }
+    }
+    select_logits_masking_implementation(LogitsMaskingImplementation::AUTO);
+}
+
+TEST_CASE("test_16bit_logits_masking", "[logitsmasking]")
+{
+    const std::size_t num_bits = 1000;
+    TokenBitmask bitmask = make_test_bitmask(num_bits);
+    for (LogitsMaskingImplementation implementation : ALL_IMPLEMENTATIONS) {
+        select_logits_masking_implementation(implementation);
+        std::vector<uint16_t> fp16_logits(num_bits, 0x3C00);
+        std::vector<uint16_t> bf16_logits(num_bits, 0x3F80);
+        apply_token_bitmask_inplace_fp16(fp16_logits.data(), fp16_logits.size(), bitmask);
+        apply_token_bitmask_inplace_bf16(bf16_logits.data(), bf16_logits.size(), bitmask);
+        for (std::size_t i = 0; i < num_bits; ++i) {
+            REQUIRE(fp16_logits[i] == (bitmask.test(i) ? 0x3C00 : 0xFC00));
+            REQUIRE(bf16_logits[i] == (bitmask.test(i) ? 0x3F80 : 0xFF80));
+        }
+    }
+    select_logits_masking_implementation(LogitsMaskingImplementation::AUTO);
+}
+
+TEST_CASE("test_token_mask_logits_masking", "[logitsmasking]")
+{
+    const std::size_t num_bits = 1000;
+    const std::size_t num_logits = 1010;
+    // Sparse, dense and almost full masks select the allow list, bitmask and deny list forms
+    std::vector<TokenBitmask> bitmasks(3, TokenBitmask(num_bits));
+    bitmasks[0].set(5);
+    bitmasks[0].set(999);
+    bitmasks[1] = make_test_bitmask(num_bits);
+    for (std::size_t token_id = 0; token_id < num_bits; ++token_id) {
+        if (token_id != 17) {
+            bitmasks[2].set(token_id);
+        }
+    }
+    const TokenMask::Kind expected_kinds[] = {TokenMask::Kind::ALLOW_LIST, TokenMask::Kind::BITMASK, TokenMask::Kind::DENY_LIST};
+    for (std::size_t i = 0; i < bitmasks.size(); ++i) {
+        TokenBitmask bitmask = bitmasks[i];
+        TokenMask mask = TokenMask::from_bitmask(std::move(bitmask));
+        REQUIRE(mask.get_kind() == expected_kinds[i]);
+        REQUIRE(mask.count() == bitmasks[i].count());
+        REQUIRE(mask.to_token_list() == bitmasks[i].to_token_list());
+
+        std::vector<float> logits(num_logits, 1.0f);
+        apply_token_mask_inplace(logits.data(), logits.size(), mask);
+        std::vector<uint16_t> bf16_logits(num_logits, 0x3F80);
+        apply_token_mask_inplace_bf16(bf16_logits.data(), bf16_logits.size(), mask);
+        for (std::size_t token_id = 0; token_id < num_logits; ++token_id) {
+            bool allowed = bitmasks[i].test(token_id);
+            REQUIRE(mask.test(token_id) == allowed);
+            REQUIRE((logits[token_id] == 1.0f) == allowed);
+            REQUIRE((bf16_logits[token_id] == 0x3F80) == allowed);
+        }
+    }
+}
@@ -3,6 +3,7 @@
 #include "./llamacpp_adapter.hpp"
 
 const char* MODEL_PATH = "phi2.gguf";
+const std::string TEST_PROMPT = "This is my question:\n\n";
 
 llama_model *model = nullptr;
 LlamaCppTokenizerData* tokenizer_data = nullptr;
@@ -37,15 +38,49 @@ std::vector<llama_token> _llama_tokenize(
     return result;
 }
 
+TokenEnforcerTokenizerData* get_test_tokenizer_data() {
+    initialize_llama_if_needed();
+    return tokenizer_data;
+}
+
+std::vector<int> tokenize_for_test(const std::string& text, bool add_bos) {
+    initialize_llama_if_needed();
+    return _llama_tokenize(model, text, add_bos);
+}
+
+void for_each_output_prefix(const std::string& output, const std::function<void(const std::vector<int>& prefix, int next_token)>& callback) {
+    initialize_llama_if_needed();
+    std::vector<int> prompt = _llama_tokenize(model, TEST_PROMPT, true);
+    std::vector<int> full_sequence = _llama_tokenize(model, TEST_PROMPT + output, true);
+    std::vector<int> prefix(full_sequence.begin(), full_sequence.begin() + prompt.size());
+    while (true) {
+        bool is_last = prefix.size() == full_sequence.size();
+        callback(prefix, is_last ? -1 : full_sequence[prefix.size()]);
+        if (is_last) {
+            break;
+        }
+        prefix.push_back(full_sequence[prefix.size()]);
+    }
+}
+
+void assert_enforcers_agree(TokenEnforcer& enforcer, TokenEnforcer& reference_enforcer, const std::vector<std::string>& outputs) {
+    for (const std::string& output : outputs) {
+        for_each_output_prefix(output, [&](const std::vector<int>& prefix, int) {
+            if (enforcer.get_allowed_tokens(prefix) != reference_enforcer.get_allowed_tokens(prefix)) {
+                throw std::runtime_error("Enforcers allow different tokens after '" + tokenizer_data->decode(prefix) + "'");
+            }
+        });
+    }
+}
+
 void assert_parser_with_string_token_enforcer(const std::string &string, CharacterLevelParserPtr parser, bool expect_success)
 {
     initialize_llama_if_needed();
 
     std::vector<llama_token> tokens_list = _llama_tokenize(model, string, true);
 
-    std::string prompt = "This is my question:\n\n";
-    std::vector<llama_token> initial_token_array = _llama_tokenize(model, prompt, true);
-    std::vector<llama_token> target_token_array = _llama_tokenize(model, prompt + string, true);
+    std::vector<llama_token> initial_token_array = _llama_tokenize(model, TEST_PROMPT, true);
+    std::vector<llama_token> target_token_array = _llama_tokenize(model, TEST_PROMPT + string, true);
     int eos_token_id = tokenizer_data->eos_token_id;
     
     TokenEnforcer token_enforcer(tokenizer_data, parser);
@@ -53,6 +88,13 @@ void assert_parser_with_string_token_enforcer(const std::string &string, Charact
     for (std::size_t prefix_length = initial_token_array.size(); prefix_length <= target_token_array.size(); ++prefix_length) {
         std::vector<int> prefix(target_token_array.begin(), target_token_array.begin() + prefix_length);
         std::vector<int> allowed_tokens = token_enforcer.get_allowed_tokens(prefix);
+        const TokenBitmask& allowed_tokens_bitmask = token_enforcer.get_allowed_tokens_bitmask(prefix);
+        if (allowed_tokens_bitmask.to_token_list() != allowed_tokens) {
+            throw std::runtime_error("Allowed token bitmask does not match allowed token list");
+        }
+        if (token_enforcer.get_allowed_tokens_mask(prefix).to_token_list() != allowed_tokens) {
+            throw std::runtime_error("Allowed token mask does not match allowed token list");
+        }
         if (prefix_length < target_token_array.size()) {
             int next_token = target_token_array[prefix_length];
             if (std::find(allowed_tokens.begin(), allowed_tokens.end(), next_token) == allowed_tokens.end()) {
@@ -62,7 +104,7 @@ void assert_parser_with_string_token_enforcer(const std::string &string, Charact
                     next_step_tokens.push_back(next_token);
                     std::string decoded_after = tokenizer_data->decode(next_step_tokens);
                     std::string next_token_chars = decoded_after.substr(decoded_before.length());
-                    std::size_t next_idx = decoded_before.length() - prompt.length();
+                    std::size_t next_idx = decoded_before.length() - TEST_PROMPT.length();
                     throw CharacterNotAllowedException("Parser does not allow '" + next_token_chars + "' at index " + std::to_string(next_idx));
                 } else {
                     return;  // Test success
@@ -87,7 +129,7 @@ void assert_parser_with_string_direct(const std::string& string, CharacterLevelP
         try
         {
             char character = string[idx];
-            if (parser->get_allowed_characters().find(character) != std::string::npos) {
+            if (parser->get_allowed_character_set().contains(character)) {
                 parser = parser->add_character(character);
             } else {
                 if (expect_success) {
@@ -114,7 +156,35 @@ void assert_parser_with_string_direct(const std::string& string, CharacterLevelP
     }
 }
 
+// add_string() must reach the state that adding the characters one by one reaches, however the string is split
+void assert_parser_with_string_bulk(const std::string& string, CharacterLevelParserPtr parser) {
+    CharacterLevelParserPtr single_character_parser = parser;
+    for (char character : string) {
+        if (!single_character_parser->get_allowed_character_set().contains(character)) {
+            single_character_parser = nullptr;
+            break;
+        }
+        single_character_parser = single_character_parser->add_character(character);
+    }
+    const std::size_t chunk_sizes[] = {string.size(), 7, 2};
+    for (std::size_t chunk_size : chunk_sizes) {
+        CharacterLevelParserPtr bulk_parser = parser;
+        for (std::size_t start = 0; bulk_parser && start < string.size(); start += std::max<std::size_t>(chunk_size, 1)) {
+            bulk_parser = bulk_parser->add_string(std::string_view(string).substr(start, chunk_size));
+        }
+        if ((bulk_parser == nullptr) != (single_character_parser == nullptr)) {
+            throw std::runtime_error("add_string() and add_character() disagree on whether '" + string + "' is allowed");
+        }
+        if (bulk_parser && (bulk_parser->can_end() != single_character_parser->can_end() ||
+                            bulk_parser->cache_key() != single_character_parser->cache_key() ||
+                            (bulk_parser->cache_key() != 0 && !bulk_parser->cache_equals(*single_character_parser)))) {
+            throw std::runtime_error("add_string() and add_character() reach different states for '" + string + "'");
+        }
+    }
+}
+
 void assert_parser_with_string(const std::string& string, CharacterLevelParserPtr parser, bool expect_success) {
     assert_parser_with_string_direct(string, parser, expect_success);
+    assert_parser_with_string_bulk(string, parser);
     assert_parser_with_string_token_enforcer(string, parser, expect_success);
 }
\ No newline at end of file
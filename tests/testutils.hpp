@@ -1,8 +1,10 @@
 #pragma once
 
 #include <lmfe/lmfe.hpp>
+#include <functional>
 #include <stdexcept>
 #include <string>
+#include <vector>
 
 
 class CharacterNotAllowedException : public std::exception {
@@ -18,3 +20,17 @@ private:
 };
 
 void assert_parser_with_string(const std::string &string, CharacterLevelParserPtr parser, bool expect_success);
+
+// Shared llama.cpp based tokenizer, initialized on first use
+TokenEnforcerTokenizerData* get_test_tokenizer_data();
+std::vector<int> tokenize_for_test(const std::string& text, bool add_bos);
+
+// The prompt that test outputs are generated after
+extern const std::string TEST_PROMPT;
+
+// Calls callback with the tokenized TEST_PROMPT, and then with each longer prefix of TEST_PROMPT + output, one token at a
+// time, so that every prefix continues the previous one. next_token is the token after the prefix, or -1 for the last one.
+void for_each_output_prefix(const std::string& output, const std::function<void(const std::vector<int>& prefix, int next_token)>& callback);
+
+// Throws if the two enforcers allow different tokens after any prefix of the outputs (see for_each_output_prefix())
+void assert_enforcers_agree(TokenEnforcer& enforcer, TokenEnforcer& reference_enforcer, const std::vector<std::string>& outputs);
@@ -0,0 +1,549 @@
+#include <catch2/catch.hpp>
+#include <string>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <future>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+#include "./testutils.hpp"
+#include <lmfe/lmfe.hpp>
+
+const std::string ENFORCER_TEST_SCHEMA = R"({"properties": {"num": {"type": "integer"}, "message": {"type": "string"}, "flag": {"type": "boolean"}}, "required": ["num", "message", "flag"], "type": "object"})";
+const std::string ENFORCER_TEST_OUTPUT = R"({"num": 12, "message": "hello world", "flag": true})";
+
+TEST_CASE("test_get_allowed_tokens_batch", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer batch_enforcer(tokenizer_data, parser);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    // Two rows that advance in lockstep through the output, and a third one that stays on the prompt
+    const std::size_t row_words = TokenBitmask::num_words(tokenizer_data->vocab_size) + 1;
+    std::vector<TokenEnforcer*> enforcers = {&batch_enforcer, &batch_enforcer, &batch_enforcer};
+    // The same output tracked by a cursor, whose batch row must match the first row
+    TokenEnforcerCursor cursor = batch_enforcer.start_sequence();
+    const TokenEnforcerCursor* cursors[] = {&cursor};
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int next_token) {
+        std::vector<int> token_ids = prefix;
+        std::vector<std::size_t> offsets = {0, token_ids.size()};
+        token_ids.insert(token_ids.end(), prefix.begin(), prefix.end());
+        offsets.push_back(token_ids.size());
+        token_ids.insert(token_ids.end(), prompt.begin(), prompt.end());
+        offsets.push_back(token_ids.size());
+
+        std::vector<TokenBitmask::Word> output(enforcers.size() * row_words, 0xFFFFFFFF);
+        TokenEnforcer::get_allowed_tokens_batch(enforcers.data(), enforcers.size(), token_ids.data(), offsets.data(), output.data(), row_words);
+
+        for (std::size_t row = 0; row < enforcers.size(); ++row) {
+            std::vector<int> sequence(token_ids.begin() + offsets[row], token_ids.begin() + offsets[row + 1]);
+            const TokenBitmask& expected = reference_enforcer.get_allowed_tokens_bitmask(sequence);
+            const TokenBitmask::Word* output_row = output.data() + row * row_words;
+            REQUIRE(std::equal(expected.data(), expected.data() + expected.word_count(), output_row));
+            REQUIRE(output_row[row_words - 1] == 0);
+        }
+
+        std::vector<TokenBitmask::Word> cursor_output(row_words, 0xFFFFFFFF);
+        TokenEnforcer::get_allowed_tokens_batch(cursors, 1, cursor_output.data(), row_words);
+        REQUIRE(std::equal(cursor_output.begin(), cursor_output.end(), output.begin()));
+        if (next_token != -1) {
+            cursor.advance(next_token);
+        }
+    });
+}
+
+TEST_CASE("test_parallel_tokenizer_tree_walk", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer parallel_enforcer(tokenizer_data, parser);
+    parallel_enforcer.set_executor(std::make_shared<ThreadPoolExecutor>(4), 1);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+    assert_enforcers_agree(parallel_enforcer, reference_enforcer, {ENFORCER_TEST_OUTPUT});
+}
+
+TEST_CASE("test_sequence_cursor", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer cursor_enforcer(tokenizer_data, parser);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    TokenEnforcerCursor cursor = cursor_enforcer.start_sequence();
+    TokenEnforcerCursor forked_cursor = cursor;
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int next_token) {
+        const TokenMask& expected = reference_enforcer.get_allowed_tokens_mask(prefix);
+        REQUIRE(cursor.get_allowed_tokens_mask().to_token_list() == expected.to_token_list());
+        if (next_token != -1) {
+            cursor.advance(next_token);
+        }
+    });
+    // Advancing one cursor does not move its copies
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    REQUIRE(forked_cursor.get_allowed_tokens_mask().to_token_list() == reference_enforcer.get_allowed_tokens(prompt));
+}
+
+TEST_CASE("test_async_cursor_advance", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    // Without an executor every advance gets a thread of its own
+    TokenEnforcer thread_enforcer(tokenizer_data, parser);
+    TokenEnforcer pool_enforcer(tokenizer_data, parser);
+    pool_enforcer.set_executor(std::make_shared<ThreadPoolExecutor>(2), 1);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    std::vector<TokenEnforcerCursor> cursors = {thread_enforcer.start_sequence(), pool_enforcer.start_sequence()};
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int next_token) {
+        // The prefix API keeps working while the cursors compute in the background
+        std::vector<int> expected = reference_enforcer.get_allowed_tokens_mask(prefix).to_token_list();
+        for (TokenEnforcerCursor& cursor : cursors) {
+            REQUIRE(cursor.get_allowed_tokens_mask().to_token_list() == expected);
+            REQUIRE(cursor.is_ready());
+        }
+        if (next_token != -1) {
+            for (TokenEnforcerCursor& cursor : cursors) {
+                cursor.advance_async(next_token);
+            }
+        }
+    });
+}
+
+TEST_CASE("test_bounded_state_cache", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer bounded_enforcer(tokenizer_data, parser);
+    bounded_enforcer.set_state_cache_limits(3, 0);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    // A cursor pins its state, so it is kept even though the budget is exceeded
+    TokenEnforcerCursor cursor = bounded_enforcer.start_sequence();
+    std::vector<int> full_sequence;
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int) {
+        REQUIRE(bounded_enforcer.get_allowed_tokens(prefix) == reference_enforcer.get_allowed_tokens(prefix));
+        REQUIRE(bounded_enforcer.get_num_cached_states() <= 3);
+        full_sequence = prefix;
+    });
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    REQUIRE(cursor.get_allowed_tokens_mask().to_token_list() == reference_enforcer.get_allowed_tokens(prompt));
+
+    bounded_enforcer.release(full_sequence);
+    REQUIRE(bounded_enforcer.get_num_cached_states() == 2);
+    bounded_enforcer.set_state_cache_limits(1, 0);
+    REQUIRE(bounded_enforcer.get_num_cached_states() == 1);
+}
+
+TEST_CASE("test_state_cache_memory_budget", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer bounded_enforcer(tokenizer_data, parser);
+    // Room for a couple of states that materialized both their token list and their bitmask
+    const std::size_t bitmask_memory = TokenBitmask::num_words(tokenizer_data->vocab_size) * sizeof(TokenBitmask::Word);
+    const std::size_t max_memory = 2 * (tokenizer_data->vocab_size * sizeof(int) + bitmask_memory);
+    bounded_enforcer.set_state_cache_limits(0, max_memory);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+    // The prompt alone maps to the root state, which is shared by every prompt and only charged for its key
+    const std::size_t prompt_length = tokenize_for_test(TEST_PROMPT, true).size();
+
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int) {
+        // Materializing a bitmask or token list after the state was cached is charged to it
+        const TokenMask& mask = reference_enforcer.get_allowed_tokens_mask(prefix);
+        std::size_t memory = reference_enforcer.get_cached_states_memory();
+        const TokenBitmask& expected_bitmask = reference_enforcer.get_allowed_tokens_bitmask(prefix);
+        if (mask.get_kind() != TokenMask::Kind::BITMASK && prefix.size() > prompt_length) {
+            REQUIRE(reference_enforcer.get_cached_states_memory() >= memory + bitmask_memory);
+        }
+        memory = reference_enforcer.get_cached_states_memory();
+        FrozenTokenVector& expected_tokens = reference_enforcer.get_allowed_tokens(prefix);
+        if (mask.get_kind() != TokenMask::Kind::ALLOW_LIST && prefix.size() > prompt_length) {
+            REQUIRE(reference_enforcer.get_cached_states_memory() >= memory + expected_tokens.size() * sizeof(int));
+        }
+
+        const TokenBitmask& bitmask = bounded_enforcer.get_allowed_tokens_bitmask(prefix);
+        REQUIRE(std::equal(bitmask.data(), bitmask.data() + bitmask.word_count(), expected_bitmask.data()));
+        REQUIRE(bounded_enforcer.get_allowed_tokens(prefix) == expected_tokens);
+        REQUIRE(bounded_enforcer.get_cached_states_memory() <= max_memory);
+    });
+    REQUIRE(bounded_enforcer.get_num_cached_states() < reference_enforcer.get_num_cached_states());
+}
+
+TEST_CASE("test_shared_allowed_token_cache", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(R"({"type": "array", "items": {"type": "integer"}})", nullptr);
+    TokenEnforcer first_enforcer(tokenizer_data, parser);
+    TokenEnforcer second_enforcer(tokenizer_data, parser);
+
+    std::vector<int> later_item;
+    for_each_output_prefix("[1, 23, ", [&](const std::vector<int>& prefix, int) {
+        first_enforcer.get_allowed_tokens(prefix);
+        later_item = prefix;
+    });
+    std::vector<int> first_item;
+    for_each_output_prefix("[1, ", [&](const std::vector<int>& prefix, int) {
+        first_enforcer.get_allowed_tokens(prefix);
+        second_enforcer.get_allowed_tokens(prefix);
+        first_item = prefix;
+    });
+    // Every list item, in every enforcer of the same parser and tokenizer, reuses the same mask
+    const TokenMask* mask = &first_enforcer.get_allowed_tokens_mask(first_item);
+    REQUIRE(&first_enforcer.get_allowed_tokens_mask(later_item) == mask);
+    REQUIRE(&second_enforcer.get_allowed_tokens_mask(first_item) == mask);
+}
+
+// Hides the wrapped parser's shortcut and cache keys, so the enforcer walks the whole tokenizer tree for it
+class FullWalkParser : public CharacterLevelParser {
+public:
+    FullWalkParser(CharacterLevelParserPtr parser) : parser(parser) {}
+
+    CharacterLevelParserPtr add_character(char new_character) override {
+        return std::make_shared<FullWalkParser>(parser->add_character(new_character));
+    }
+
+    CharacterSet get_allowed_character_set() const override { return parser->get_allowed_character_set(); }
+    bool can_end() const override { return parser->can_end(); }
+
+private:
+    CharacterLevelParserPtr parser;
+};
+
+TEST_CASE("test_character_class_shortcuts", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    // Free text strings, digits and whitespace runs
+    const std::vector<std::pair<std::string, std::vector<std::string>>> schemas_and_outputs = {
+        {R"({"type": "object", "properties": {"message": {"type": "string"}}})", {R"({"message": "hello world"})"}},
+        {R"({"type": "object", "properties": {"message": {"type": "string", "minLength": 4, "maxLength": 7}}})", {R"({"message": "a, b  c"})", R"({"message": "hello world"})"}},
+        {R"({"type": "array", "items": {"type": "number"}})", {"[1, 234567, -8.25,\n    90   ]"}},
+        {ENFORCER_TEST_SCHEMA, {ENFORCER_TEST_OUTPUT, "{\n  \"num\": 1234,\n  \"message\": \"hi\",\n  \"flag\": false\n}"}},
+    };
+    for (const auto& schema_and_outputs : schemas_and_outputs) {
+        CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(schema_and_outputs.first, nullptr);
+        TokenEnforcer shortcut_enforcer(tokenizer_data, parser);
+        TokenEnforcer reference_enforcer(tokenizer_data, std::make_shared<FullWalkParser>(parser));
+        assert_enforcers_agree(shortcut_enforcer, reference_enforcer, schema_and_outputs.second);
+    }
+}
+
+TEST_CASE("test_forced_continuation", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer token_enforcer(tokenizer_data, parser);
+    // The enforcer only recognizes sequences that it saw grow token by token from the prompt
+    auto tokenize_output = [&](const std::string& output) {
+        std::vector<int> full_sequence;
+        for_each_output_prefix(output, [&](const std::vector<int>& prefix, int) {
+            token_enforcer.get_allowed_tokens(prefix);
+            full_sequence = prefix;
+        });
+        return full_sequence;
+    };
+
+    std::vector<int> key_prefix = tokenize_output(R"({"num": 12, "m)");
+    REQUIRE(token_enforcer.get_forced_continuation(key_prefix).characters == "essage\"");
+    ForcedContinuation continuation = token_enforcer.get_forced_continuation(key_prefix, true);
+    REQUIRE(continuation.characters == "essage\":\"");
+    REQUIRE(tokenizer_data->decode(continuation.token_ids) == continuation.characters);
+    // Every forced token is allowed after the previous ones
+    std::vector<int> sequence = key_prefix;
+    for (int token_id : continuation.token_ids) {
+        std::vector<int> allowed_tokens = token_enforcer.get_allowed_tokens(sequence);
+        REQUIRE(std::find(allowed_tokens.begin(), allowed_tokens.end(), token_id) != allowed_tokens.end());
+        sequence.push_back(token_id);
+    }
+
+    std::vector<int> value_prefix = tokenize_output(R"({"num": 12, "message": "hi", "flag": t)");
+    REQUIRE(token_enforcer.get_forced_continuation(value_prefix, true).characters == "rue}");
+    std::vector<int> choice_prefix = tokenize_output(R"({"num": 12, ")");
+    REQUIRE(token_enforcer.get_forced_continuation(choice_prefix, true).characters.empty());
+
+    TokenEnforcerCursor cursor = token_enforcer.start_sequence();
+    REQUIRE(cursor.get_forced_continuation(true).characters == "{\"");
+}
+
+TEST_CASE("test_verify_draft", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer draft_enforcer(tokenizer_data, parser);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    std::vector<int> full_sequence = tokenize_for_test(TEST_PROMPT + ENFORCER_TEST_OUTPUT, true);
+    std::vector<int> draft(full_sequence.begin() + prompt.size(), full_sequence.end());
+    // The end of sequence token is not allowed in the middle of the object
+    const std::size_t num_valid_draft_tokens = draft.size() / 2;
+    draft[num_valid_draft_tokens] = tokenizer_data->eos_token_id;
+
+    const std::size_t row_words = TokenBitmask::num_words(tokenizer_data->vocab_size);
+    std::vector<TokenBitmask::Word> output((draft.size() + 1) * row_words, 0xFFFFFFFF);
+    std::size_t num_accepted = draft_enforcer.verify_draft(prompt, draft.data(), draft.size(), output.data(), row_words);
+    REQUIRE(num_accepted == num_valid_draft_tokens);
+    for (std::size_t row = 0; row <= draft.size(); ++row) {
+        const TokenBitmask::Word* output_row = output.data() + row * row_words;
+        if (row > num_accepted) {
+            REQUIRE(std::all_of(output_row, output_row + row_words, [](TokenBitmask::Word word) { return word == 0; }));
+            continue;
+        }
+        std::vector<int> sequence(full_sequence.begin(), full_sequence.begin() + prompt.size() + row);
+        const TokenBitmask& expected = reference_enforcer.get_allowed_tokens_bitmask(sequence);
+        REQUIRE(std::equal(expected.data(), expected.data() + expected.word_count(), output_row));
+    }
+
+    // Generation continues from the accepted draft
+    std::vector<int> continued_sequence(full_sequence.begin(), full_sequence.begin() + prompt.size() + num_accepted + 1);
+    REQUIRE(draft_enforcer.get_allowed_tokens(continued_sequence) == reference_enforcer.get_allowed_tokens(continued_sequence));
+
+    // Or from a shorter part of it, when the target model rejects a draft token and samples one of its own instead
+    const std::size_t num_model_accepted = num_accepted / 2;
+    REQUIRE(num_model_accepted > 0);
+    std::vector<int> model_sequence(full_sequence.begin(), full_sequence.begin() + prompt.size() + num_model_accepted);
+    std::vector<int> model_allowed = reference_enforcer.get_allowed_tokens(model_sequence);
+    model_sequence.push_back(model_allowed.front() == draft[num_model_accepted] ? model_allowed.back() : model_allowed.front());
+    REQUIRE(draft_enforcer.get_allowed_tokens(model_sequence) == reference_enforcer.get_allowed_tokens(model_sequence));
+}
+
+TEST_CASE("test_verify_tree", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer tree_enforcer(tokenizer_data, parser);
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    std::vector<int> full_sequence = tokenize_for_test(TEST_PROMPT + ENFORCER_TEST_OUTPUT, true);
+    std::vector<int> output_tokens(full_sequence.begin() + prompt.size(), full_sequence.end());
+    const int eos_token_id = tokenizer_data->eos_token_id;
+    // Node 2 is disallowed, so its child node 3 is as well. Node 5 is a disallowed first token.
+    const std::vector<int> tree_tokens = {output_tokens[0], output_tokens[1], eos_token_id, output_tokens[2], output_tokens[2], eos_token_id};
+    const std::vector<int> parent_indices = {-1, 0, 0, 2, 1, -1};
+    const std::vector<bool> expected_allowed = {true, true, false, false, true, false};
+
+    const std::size_t row_words = TokenBitmask::num_words(tokenizer_data->vocab_size);
+    std::vector<TokenBitmask::Word> output(tree_tokens.size() * row_words, 0xFFFFFFFF);
+    bool node_allowed[6];
+    tree_enforcer.verify_tree(prompt, tree_tokens.data(), parent_indices.data(), tree_tokens.size(), node_allowed, output.data(), row_words);
+    for (std::size_t node_idx = 0; node_idx < tree_tokens.size(); ++node_idx) {
+        REQUIRE(node_allowed[node_idx] == expected_allowed[node_idx]);
+        const TokenBitmask::Word* output_row = output.data() + node_idx * row_words;
+        if (!node_allowed[node_idx]) {
+            REQUIRE(std::all_of(output_row, output_row + row_words, [](TokenBitmask::Word word) { return word == 0; }));
+        }
+    }
+    // Nodes 0, 1 and 4 spell the start of the output
+    for (std::size_t path_length = 0; path_length <= 3; ++path_length) {
+        std::vector<int> sequence(full_sequence.begin(), full_sequence.begin() + prompt.size() + path_length);
+        const TokenBitmask& expected = reference_enforcer.get_allowed_tokens_bitmask(sequence);
+        if (path_length > 0) {
+            const int node_idx = path_length == 3 ? 4 : static_cast<int>(path_length) - 1;
+            const TokenBitmask::Word* output_row = output.data() + node_idx * row_words;
+            REQUIRE(std::equal(expected.data(), expected.data() + expected.word_count(), output_row));
+        }
+    }
+
+    // Generation continues from the accepted path
+    std::vector<int> continued_sequence(full_sequence.begin(), full_sequence.begin() + prompt.size() + 4);
+    REQUIRE(tree_enforcer.get_allowed_tokens(continued_sequence) == reference_enforcer.get_allowed_tokens(continued_sequence));
+}
+
+TEST_CASE("test_filter_allowed_candidates", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer filtering_enforcer(tokenizer_data, std::make_shared<FullWalkParser>(parser));
+    TokenEnforcer reference_enforcer(tokenizer_data, parser);
+
+    std::vector<int> all_tokens(tokenizer_data->vocab_size);
+    std::iota(all_tokens.begin(), all_tokens.end(), 0);
+    for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>& prefix, int next_token) {
+        std::vector<int> expected = reference_enforcer.get_allowed_tokens(prefix);
+        // Candidate checks and the full mask agree on every token
+        REQUIRE(filtering_enforcer.filter_allowed_candidates(prefix, all_tokens, all_tokens.size()) == expected);
+        if (next_token != -1) {
+            std::vector<int> candidates = {tokenizer_data->eos_token_id, next_token, expected.back()};
+            std::vector<int> allowed_candidates = filtering_enforcer.filter_allowed_candidates(prefix, candidates);
+            REQUIRE(allowed_candidates.size() == 1);
+            REQUIRE(allowed_candidates[0] == next_token);
+        }
+    });
+
+    // When every candidate is rejected, the full mask is computed for resampling
+    std::vector<int> prompt = tokenize_for_test(TEST_PROMPT, true);
+    std::vector<int> rejected_candidates = {tokenizer_data->eos_token_id};
+    REQUIRE(filtering_enforcer.filter_allowed_candidates(prompt, rejected_candidates).empty());
+    REQUIRE(filtering_enforcer.get_allowed_tokens(prompt) == reference_enforcer.get_allowed_tokens(prompt));
+}
+
+// Serves the vocabulary of the shared test tokenizer, optionally without its last regular token
+class CopiedTokenizerData : public TokenEnforcerTokenizerData {
+public:
+    CopiedTokenizerData(TokenEnforcerTokenizerData* source, bool drop_last_token = false) : source(source), drop_last_token(drop_last_token) {}
+
+    std::string decode(const std::vector<int>& tokens) const override { return source->decode(tokens); }
+
+protected:
+    std::vector<std::tuple<int, std::string, bool>> get_regular_tokens() const override {
+        std::vector<std::tuple<int, std::string, bool>> tokens = source->regular_tokens;
+        if (drop_last_token) {
+            tokens.pop_back();
+        }
+        return tokens;
+    }
+    int get_eos_token_id() const override { return source->eos_token_id; }
+
+private:
+    TokenEnforcerTokenizerData* source;
+    bool drop_last_token;
+};
+
+TEST_CASE("test_tokenizer_file", "[enforcer]")
+{
+    const std::string path = "test_tokenizer_file.bin";
+    TokenEnforcerTokenizerData* source = get_test_tokenizer_data();
+    CopiedTokenizerData built_data(source, false);
+    built_data.initialize();
+    built_data.save_to_file(path);
+
+    CopiedTokenizerData loaded_data(source, false);
+    REQUIRE(loaded_data.initialize_from_file(path));
+    REQUIRE(loaded_data.regular_tokens.empty());
+    REQUIRE(loaded_data.eos_token_id == built_data.eos_token_id);
+    REQUIRE(loaded_data.vocab_size == built_data.vocab_size);
+    REQUIRE(loaded_data.tokenizer_alphabet == built_data.tokenizer_alphabet);
+    const TokenizerPrefixTree& built_tree = *built_data.tokenizer_tree;
+    const TokenizerPrefixTree& loaded_tree = *loaded_data.tokenizer_tree;
+    REQUIRE(loaded_tree.nodes.size() == built_tree.nodes.size());
+    REQUIRE(std::equal(built_tree.node_characters.begin(), built_tree.node_characters.end(), loaded_tree.node_characters.begin()));
+    REQUIRE(std::equal(built_tree.token_pool.begin(), built_tree.token_pool.end(), loaded_tree.token_pool.begin()));
+    REQUIRE(loaded_tree.token_infos.size() == built_tree.token_infos.size());
+    REQUIRE(std::memcmp(loaded_tree.token_infos.data(), built_tree.token_infos.data(), built_tree.token_infos.size() * sizeof(TokenInfo)) == 0);
+    for (const auto& token : source->regular_tokens) {
+        REQUIRE(loaded_tree.get_token_string(std::get<0>(token)) == std::get<1>(token));
+        REQUIRE(loaded_tree.is_new_word_token(std::get<0>(token)) == std::get<2>(token));
+    }
+
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer built_enforcer(&built_data, parser);
+    TokenEnforcer loaded_enforcer(&loaded_data, parser);
+    assert_enforcers_agree(loaded_enforcer, built_enforcer, {ENFORCER_TEST_OUTPUT});
+
+    // Loading over an initialized tokenizer replaces its tree and drops the token list the old tree was built from
+    REQUIRE(built_data.initialize_from_file(path));
+    REQUIRE(built_data.regular_tokens.empty());
+    REQUIRE(built_data.tokenizer_tree->nodes.size() == loaded_tree.nodes.size());
+
+    // A file is only used with the vocabulary it was written for, and only while it is intact
+    CopiedTokenizerData other_vocabulary_data(source, true);
+    REQUIRE_FALSE(other_vocabulary_data.initialize_from_file(path));
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekg(-1, std::ios::end);
+        char last_byte = static_cast<char>(file.get());
+        file.seekp(-1, std::ios::end);
+        file.put(static_cast<char>(last_byte ^ 1));
+    }
+    CopiedTokenizerData damaged_data(source, false);
+    REQUIRE_FALSE(damaged_data.initialize_from_file(path));
+    std::remove(path.c_str());
+    CopiedTokenizerData missing_data(source, false);
+    REQUIRE_FALSE(missing_data.initialize_from_file(path));
+}
+
+TEST_CASE("test_token_info_table", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* tokenizer_data = get_test_tokenizer_data();
+    const TokenizerPrefixTree& tokenizer_tree = *tokenizer_data->tokenizer_tree;
+    for (const auto& token : tokenizer_data->regular_tokens) {
+        int token_id = std::get<0>(token);
+        const std::string& token_str = std::get<1>(token);
+        const TokenInfo& info = tokenizer_tree.token_infos[token_id];
+        REQUIRE(std::string(tokenizer_tree.get_token_characters(token_id), info.string_length) == token_str);
+        REQUIRE(info.first_character == (token_str.empty() ? '\0' : token_str[0]));
+        REQUIRE(tokenizer_tree.is_new_word_token(token_id) == std::get<2>(token));
+
+        uint32_t tree_node = TokenizerPrefixTree::ROOT;
+        for (char character : token_str) {
+            tree_node = tokenizer_tree.find_child(tree_node, character);
+        }
+        REQUIRE(info.tree_node == tree_node);
+
+        bool is_digits_only = !token_str.empty() && token_str.find_first_not_of("0123456789") == std::string::npos;
+        bool is_whitespace_only = !token_str.empty() && token_str.find_first_not_of(" \t\n\r") == std::string::npos;
+        REQUIRE(tokenizer_tree.has_token_flags(token_id, TokenInfo::DIGITS_ONLY) == is_digits_only);
+        REQUIRE(tokenizer_tree.has_token_flags(token_id, TokenInfo::WHITESPACE_ONLY) == is_whitespace_only);
+        REQUIRE(tokenizer_tree.has_token_flags(token_id, TokenInfo::CONTAINS_QUOTE) == (token_str.find('"') != std::string::npos));
+        REQUIRE(tokenizer_tree.has_token_flags(token_id, TokenInfo::CONTAINS_BACKSLASH) == (token_str.find('\\') != std::string::npos));
+    }
+    REQUIRE_FALSE(tokenizer_tree.is_regular_token(tokenizer_data->eos_token_id));
+    REQUIRE_FALSE(tokenizer_tree.is_regular_token(-1));
+    REQUIRE_FALSE(tokenizer_tree.is_regular_token(tokenizer_data->vocab_size));
+}
+
+// Decodes to upper case, so that decode() disagrees with the token strings
+class UpperCaseDecodingTokenizerData : public CopiedTokenizerData {
+public:
+    using CopiedTokenizerData::CopiedTokenizerData;
+
+    std::string decode(const std::vector<int>& tokens) const override {
+        std::string decoded = CopiedTokenizerData::decode(tokens);
+        std::transform(decoded.begin(), decoded.end(), decoded.begin(), ::toupper);
+        return decoded;
+    }
+};
+
+TEST_CASE("test_incremental_decoding", "[enforcer]")
+{
+    TokenEnforcerTokenizerData* source = get_test_tokenizer_data();
+    CopiedTokenizerData decode_data(source);
+    decode_data.incremental_decoding = IncrementalDecoding::DECODE;
+    decode_data.initialize();
+    CopiedTokenizerData verify_data(source);
+    verify_data.incremental_decoding = IncrementalDecoding::VERIFY;
+    verify_data.initialize();
+
+    CharacterLevelParserPtr parser = std::make_shared<JsonSchemaParser>(ENFORCER_TEST_SCHEMA, nullptr);
+    TokenEnforcer table_enforcer(source, parser);
+    TokenEnforcer decode_enforcer(&decode_data, parser);
+    TokenEnforcer verify_enforcer(&verify_data, parser);
+    assert_enforcers_agree(table_enforcer, decode_enforcer, {ENFORCER_TEST_OUTPUT});
+    assert_enforcers_agree(verify_enforcer, decode_enforcer, {ENFORCER_TEST_OUTPUT});
+
+    UpperCaseDecodingTokenizerData mismatching_data(source);
+    mismatching_data.incremental_decoding = IncrementalDecoding::VERIFY;
+    mismatching_data.initialize();
+    TokenEnforcer mismatching_enforcer(&mismatching_data, parser);
+    TokenEnforcerCursor cursor = mismatching_enforcer.start_sequence();
+    REQUIRE_THROWS_AS(for_each_output_prefix(ENFORCER_TEST_OUTPUT, [&](const std::vector<int>&, int next_token) {
+        if (next_token != -1) {
+            cursor.advance(next_token);
+        }
+    }), LMFormatEnforcerException);
+}
+
+TEST_CASE("test_thread_pool_executor", "[enforcer]")
+{
+    ThreadPoolExecutor executor(3);
+    REQUIRE(executor.concurrency() == 3);
+    std::vector<int> results(100, 0);
+    std::vector<std::function<void()>> tasks;
+    for (int i = 0; i < 100; ++i) {
+        tasks.push_back([i, &results]() { results[i] = i * i; });
+    }
+    executor.run_all(tasks);
+    for (int i = 0; i < 100; ++i) {
+        REQUIRE(results[i] == i * i);
+    }
+    tasks.push_back([]() { throw std::runtime_error("task failed"); });
+    REQUIRE_THROWS_AS(executor.run_all(tasks), std::runtime_error);
+
+    std::promise<int> submitted_result;
+    executor.submit([&submitted_result]() { submitted_result.set_value(42); });
+    REQUIRE(submitted_result.get_future().get() == 42);
+}